@@ -18,8 +18,11 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <ctype.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -40,6 +43,10 @@
 #define REF_ONLY 0
 #endif
 
+/* Scaling mode */
+#define SCALE_REPS     3          /* keep the best of this many runs per thread count */
+#define MAX_THREADS  1024         /* max number of threads in an annotated trace */
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
@@ -80,9 +87,12 @@ typedef struct {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
+    enum { ALLOC, FREE, REALLOC, BARRIER, ALLOC_BATCH, FREE_BATCH } type; /* type of request */
     long index;                         /* index for free() to use later */
     size_t size;                        /* byte size of alloc/realloc request */
+    int count;                          /* ids index.. of a batch request, 1 otherwise */
+    int thread;                         /* thread issuing the request (-1 for barriers) */
+    int dep;                            /* earlier request on another thread to wait for, or -1 */
 } traceop_t;
 
 /* Holds the information for one trace file */
@@ -91,6 +101,9 @@ typedef struct {
     size_t data_bytes;    /* Peak number of data bytes allocated during trace */
     int num_ids;          /* number of alloc/realloc ids */
     int num_ops;          /* number of distinct requests */
+    long num_requests;    /* number of requests, a batch counts once per id */
+    int num_threads;      /* number of threads named in the trace (1 if none) */
+    int num_remote;       /* number of cross-thread frees (F requests) */
     weight_t weight;      /* weight for this trace */
     traceop_t *ops;       /* array of requests */
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
@@ -107,6 +120,46 @@ typedef struct {
     trace_t *trace;
 } speed_t;
 
+/*
+ * Holds the params and results of one replay thread in scaling mode.
+ * Every thread has its own blocks array, so the trace's ops can be
+ * shared read-only between the threads.
+ */
+typedef struct {
+    trace_t *trace;
+    int tid;                      /* this thread's number, from 0 */
+    int nthreads;                 /* number of threads in this run */
+    bool slice;                   /* replay only the ids with id % nthreads == tid */
+    char **blocks;                /* private copy of trace->blocks */
+    pthread_barrier_t *barrier;   /* released once every thread is ready */
+    long ops;                     /* number of requests replayed */
+    double start;                 /* time the replay started, in secs */
+    double end;                   /* time the replay finished, in secs */
+    double wait;                  /* secs spent blocked on ordering (threaded replay) */
+    long frees[2];                /* local and remote frees (threaded replay) */
+    double free_secs[2];          /* secs spent in local and remote frees */
+    char *done;                   /* per-request completion flags (threaded replay) */
+} replay_t;
+
+/* Summarizes one run of the scaling mode for a given thread count */
+typedef struct {
+    double agg_tput;   /* aggregate throughput in Kops/s */
+    double min_tput;   /* slowest thread in Kops/s */
+    double avg_tput;   /* mean over the threads in Kops/s */
+    double max_tput;   /* fastest thread in Kops/s */
+} scale_stats_t;
+
+/* Resident-set figures of the mm package on one trace (footprint mode) */
+typedef struct {
+    int every;         /* ops between two samples */
+    double live_peak;  /* peak payload bytes */
+    double heap_peak;  /* peak bytes of heap and mappings */
+    double rss_peak;   /* peak resident bytes of heap and mappings */
+    double live_avg;   /* payload bytes, averaged over the samples */
+    double heap_avg;   /* heap and mapping bytes, averaged over the samples */
+    double rss_avg;    /* resident bytes, averaged over the samples */
+} footprint_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set in read_trace */
@@ -161,6 +214,23 @@ static bool onetime_flag = false;
 static bool tab_mode = false;     /* Print output as tab-separated fields */
 static size_t maxfill = MAXFILL;
 
+/* Scaling mode: replay each trace with 1..scale_max threads (-P, -S) */
+static int scale_max = 0;         /* 0 means scaling mode is off */
+static bool scale_slice = false;  /* split the trace between threads instead of copying it */
+
+/* Footprint mode: sample the resident pages every footprint_every ops (-R) */
+static int footprint_every = 0;   /* 0 means footprint mode is off */
+
+/* Walk mode: report the cycles prefetching saves per list node (-W) */
+static bool walk_report = false;
+static bool walk_prefetch = true; /* prefetch in the list walks of mm.c */
+
+/* Fit policy of the mm package (-F), by name */
+static const char *fit_names[] = {
+    "first", "best", "next", "good", "address", NULL
+};
+static int fit_policy = MM_FIT_FIRST;
+
 /* by default, no timeouts */
 static int set_timeout = 0;
 
@@ -215,9 +285,21 @@ static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
+static bool init_mm(void);
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static void touch_pages(char *p, size_t lo, size_t hi);
+static double eval_mm_util(trace_t *trace, int tracenum, footprint_t *fp);
+static void print_footprint(const stats_t *stats, const footprint_t *fp);
+static void print_walk(const stats_t *stats, speed_t *speed_params);
 static void eval_mm_speed(void *ptr);
+static double get_secs(void);
+static void *replay_thread(void *ptr);
+static void eval_mm_scale(trace_t *trace, int nthreads, bool slice,
+                          scale_stats_t *stats);
+static void print_scaling(const stats_t *stats, trace_t *trace);
+static void *trace_thread(void *ptr);
+static void eval_mm_threaded(trace_t *trace, replay_t *replays);
+static void print_threaded(const stats_t *stats, trace_t *trace);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
@@ -249,6 +331,7 @@ static void run_tests(int num_tracefiles, const char *tracedir,
                       char **tracefiles, 
                       stats_t *mm_stats, speed_t *speed_params) {
     volatile int i;
+    footprint_t fp;
 
     for (i=0; i < num_tracefiles; i++) {
         /* initialize simulated memory system in memlib.c *
@@ -262,7 +345,7 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         trace_t *trace;
         trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
         strcpy(mm_stats[i].filename, trace->filename);
-        mm_stats[i].ops = trace->num_ops;
+        mm_stats[i].ops = trace->num_requests;
 
         /* Prepare for timeout */
         if (setjmp(timeout_jmpbuf) != 0) {
@@ -282,11 +365,20 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         if (mm_stats[i].valid) {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].util = eval_mm_util(trace, i,
+                                            footprint_every > 0 ? &fp : NULL);
             speed_params->trace = trace;
             if (verbose > 1)
                 printf("and performance.\n");
             mm_stats[i].secs = fsec(eval_mm_speed, speed_params);
+            if (footprint_every > 0)
+                print_footprint(&mm_stats[i], &fp);
+            if (walk_report)
+                print_walk(&mm_stats[i], speed_params);
+            if (scale_max > 0)
+                print_scaling(&mm_stats[i], trace);
+            if (trace->num_threads > 1)
+                print_threaded(&mm_stats[i], trace);
         }
 
 #if 0
@@ -356,7 +448,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hOVlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:F:P:R:hOVlDSTW")) != EOF) {
         switch (c) {
 
             case 'f': /* Use one specific trace file only (relative to curr dir) */
@@ -406,6 +498,38 @@ int main(int argc, char **argv)
                 tab_mode = true;
                 break;
 
+            case 'F': /* Fit policy of the mm package */
+                for (fit_policy = 0; fit_names[fit_policy] != NULL; fit_policy++)
+                    if (strcmp(optarg, fit_names[fit_policy]) == 0)
+                        break;
+                if (fit_names[fit_policy] == NULL) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+
+            case 'P': /* Scaling mode with up to <n> threads (0: one per core) */
+                scale_max = atoi(optarg);
+                if (scale_max <= 0)
+                    scale_max = (int)sysconf(_SC_NPROCESSORS_ONLN);
+                if (scale_max <= 0)
+                    scale_max = 1;
+                break;
+
+            case 'S': /* Scaling mode splits the trace instead of copying it */
+                scale_slice = true;
+                break;
+
+            case 'R': /* Footprint mode, sample resident pages every <n> ops */
+                footprint_every = atoi(optarg);
+                if (footprint_every <= 0)
+                    footprint_every = 1;
+                break;
+
+            case 'W': /* Walk mode, cycles per list node with and without prefetch */
+                walk_report = true;
+                break;
+
             case 'h': /* Print this message */
                 usage(argv[0]);
                 exit(0);
@@ -515,7 +639,7 @@ int main(int argc, char **argv)
                 printf(" => incorrect.\n\n");
             }
         } else {
-            printf("\nResults for mm malloc:\n");
+            printf("\nResults for mm malloc (%s fit):\n", fit_names[fit_policy]);
             printresults(num_global_tracefiles, mm_stats, &global_mm_sum_stats);
             printf("\n");
         }
@@ -712,12 +836,15 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or of the
+       area of mappings made by mm_mmap */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        ((lo < (char *)mem_map_lo()) || (hi > (char *)mem_map_hi()))) {
         malloc_error(trace, opnum,
-                     "Payload (%p:%p) lies outside heap (%p:%p)",
-                     lo, hi, mem_heap_lo(), mem_heap_hi());
+                     "Payload (%p:%p) lies outside heap (%p:%p) and mappings (%p:%p)",
+                     lo, hi, mem_heap_lo(), mem_heap_hi(),
+                     mem_map_lo(), mem_map_hi());
         return false;
     }
 
@@ -937,6 +1064,9 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     int max_index = 0;
     int op_index;
     int ignore = 0;
+    int thread;
+    int count;
+    int *last_op;     /* last request on each id, or -1 */
 
     if (verbose > 1)
         printf("Reading tracefile: %s\n", filename);
@@ -982,11 +1112,41 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
          calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
         unix_error("malloc 5 failed in read_trace");
 
+    /* Ordering between threads is derived from the last request on each id */
+    if ((last_op = (int *)malloc(trace->num_ids * sizeof(int))) == NULL)
+        unix_error("malloc 6 failed in read_trace");
+    memset(last_op, -1, trace->num_ids * sizeof(int));
+    trace->num_threads = 1;
+    trace->num_remote = 0;
+    trace->num_requests = 0;
 
-    /* read every request line in the trace file */
+    /*
+     * read every request line in the trace file. A line may start with
+     * the number of the thread that issues it; lines without one belong
+     * to thread 0. "F <id>" frees a block last allocated on another
+     * thread, and "b" is an ordering point that every thread reaches
+     * before any of them goes on. "A <id> <n> <size>" allocates ids
+     * id..id+n-1 with one mm_malloc_batch, "B <id> <n>" frees them with
+     * one mm_free_batch.
+     */
     index = 0;
     op_index = 0;
     while (fscanf(tracefile, "%s", type) != EOF) {
+        thread = 0;
+        if (isdigit((unsigned char)type[0])) {
+            thread = atoi(type);
+            if (thread >= MAX_THREADS)
+                app_error("Thread %d out of range in tracefile %s\n",
+                          thread, trace->filename);
+            if (fscanf(tracefile, "%s", type) == EOF)
+                app_error("Missing request after thread %d in tracefile %s\n",
+                          thread, trace->filename);
+            if (thread >= trace->num_threads)
+                trace->num_threads = thread + 1;
+        }
+        trace->ops[op_index].thread = thread;
+        trace->ops[op_index].dep = -1;
+        trace->ops[op_index].count = 1;
         switch(type[0]) {
             case 'a':
                 ignore += fscanf(tracefile, "%u %lu", &index, &size);
@@ -1003,25 +1163,76 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
                 max_index = (index > max_index) ? index : max_index;
                 break;
             case 'f':
+            case 'F':
                 ignore += fscanf(tracefile, "%u", &index);
                 trace->ops[op_index].type = FREE;
                 trace->ops[op_index].index = index;
                 break;
+            case 'A':
+                ignore += fscanf(tracefile, "%u %d %lu", &index, &count, &size);
+                if (count < 1)
+                    app_error("Batch of %d blocks in tracefile %s\n",
+                              count, trace->filename);
+                trace->ops[op_index].type = ALLOC_BATCH;
+                trace->ops[op_index].index = index;
+                trace->ops[op_index].size = size;
+                trace->ops[op_index].count = count;
+                max_index = (index + count - 1 > max_index) ?
+                    index + count - 1 : max_index;
+                break;
+            case 'B':
+                ignore += fscanf(tracefile, "%u %d", &index, &count);
+                if (count < 1)
+                    app_error("Batch of %d blocks in tracefile %s\n",
+                              count, trace->filename);
+                trace->ops[op_index].type = FREE_BATCH;
+                trace->ops[op_index].index = index;
+                trace->ops[op_index].count = count;
+                break;
+            case 'b':
+                trace->ops[op_index].type = BARRIER;
+                trace->ops[op_index].index = -1;
+                trace->ops[op_index].size = 0;
+                trace->ops[op_index].thread = -1;
+                break;
             default:
                 app_error("Bogus type character (%c) in tracefile %s\n",
                           type[0], trace->filename);
         }
+
+        /* A request on a block last touched by another thread waits for it,
+           a batch for the latest such request on any of its ids */
+        count = type[0] == 'b' ? 0 : trace->ops[op_index].count;
+        for (int id = index; id >= 0 && id < index + count; id++) {
+            if (id >= trace->num_ids)
+                app_error("Id %d out of range in tracefile %s\n",
+                          id, trace->filename);
+            int last = last_op[id];
+            bool remote = last >= 0 && trace->ops[last].thread != thread;
+            if ((type[0] == 'f' || type[0] == 'B') && remote)
+                app_error("Free of block %d on thread %d must be marked F "
+                          "in tracefile %s\n", id, thread, trace->filename);
+            if (type[0] == 'F' && !remote)
+                app_error("Free of block %d on thread %d is not cross-thread "
+                          "in tracefile %s\n", id, thread, trace->filename);
+            if (remote && last > trace->ops[op_index].dep)
+                trace->ops[op_index].dep = last;
+            trace->num_remote += type[0] == 'F';
+            last_op[id] = op_index;
+        }
+        trace->num_requests += count;
         op_index++;
         if (op_index == trace->num_ops) break;
     }
     fclose(tracefile);
+    free(last_op);
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
 
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
     stats->weight = trace->weight;
-    stats->ops = trace->num_ops;
+    stats->ops = trace->num_requests;
 
     return trace;
 }
@@ -1054,12 +1265,25 @@ static void free_trace(trace_t *trace)
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * init_mm - Initialize the mm package, then set the fit policy and
+ *    prefetching, which are part of the heap and start over each time.
+ */
+static bool init_mm(void)
+{
+    if (!mm_init())
+        return false;
+    mm_set_fit_policy(fit_policy);
+    mm_set_prefetch(walk_prefetch);
+    return true;
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 {
-    int i;
+    int i, j, n;
     int index;
     size_t size;
     char *newp;
@@ -1072,7 +1296,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     reset_range_set(ranges);
 
     /* Call the mm package's init function */
-    if (!mm_init()) {
+    if (!init_mm()) {
         malloc_error(trace, 0, "mm_init failed.");
         return false;
     }
@@ -1183,6 +1407,35 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
                 mm_free(p);
                 break;
 
+            case ALLOC_BATCH: /* mm_malloc_batch */
+                n = trace->ops[i].count;
+                if (mm_malloc_batch(size, n, (void **)&trace->blocks[index]) != (size_t)n) {
+                    malloc_error(trace, i, "mm_malloc_batch failed.");
+                    return false;
+                }
+
+                /* Check and remember every block like a single malloc */
+                for (j = index; j < index + n; j++) {
+                    if (add_range(ranges, trace->blocks[j], size, trace, i, j) == 0)
+                        return false;
+                    trace->block_sizes[j] = size;
+                    randomize_block(trace, j);
+                }
+                break;
+
+            case FREE_BATCH: /* mm_free_batch */
+                n = trace->ops[i].count;
+                for (j = index; j < index + n; j++) {
+                    if (!check_index(trace, i, j, 0))
+                        return false;
+                    remove_range(ranges, trace->blocks[j]);
+                }
+                mm_free_batch((void **)&trace->blocks[index], n);
+                break;
+
+            case BARRIER: /* ordering point, nothing to do serially */
+                break;
+
             default:
                 app_error("Nonexistent request type in eval_mm_valid");
         }
@@ -1191,35 +1444,58 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     return true;
 }
 
+/*
+ * touch_pages - Writes one byte in each page of the payload bytes
+ *    [lo, hi) of block p, like a program storing its data would, so
+ *    footprint mode counts them as resident.
+ */
+static void touch_pages(char *p, size_t lo, size_t hi)
+{
+    size_t page = mem_pagesize();
+    size_t off;
+
+    for (off = lo; off < hi; off = (off / page + 1) * page)
+        p[off] = 0;
+}
+
 /*
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   peak size of the heap in bytes, plus the bytes mapped by mm_mmap
+ *   at the time, while running the student's malloc package on the
+ *   trace.
  *
  *   A higher number is better: 1 is optimal.
+ *
+ *   In footprint mode (fp != NULL), the resident pages are sampled as
+ *   well, and the payload is written like a program would, so pages
+ *   the package never hands out or gives back don't count.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, footprint_t *fp)
 {
-    int i;
+    int i, j, n;
     int index;
     size_t size, newsize, oldsize;
     size_t max_total_size = 0;
     size_t total_size = 0;
     size_t max_heap_size = 0;
     size_t heap_size = 0;
+    size_t rss, max_rss = 0;
+    double sum_total = 0, sum_heap = 0, sum_rss = 0;
+    int samples = 0;
     char *p;
     char *newp, *oldp;
 
     reinit_trace(trace);
 
-    /* initialize the heap and the mm malloc package */
+    /* initialize the heap and the mm malloc package; in footprint mode,
+       pages touched by earlier runs must not count as resident */
+    if (fp != NULL)
+        mem_decommit();
     mem_reset_brk();
-    if (!mm_init())
+    if (!init_mm())
         app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
 
     for (i = 0;  i < trace->num_ops;  i++) {
@@ -1237,6 +1513,8 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 /* Remember region and size */
                 trace->blocks[index] = p;
                 trace->block_sizes[index] = size;
+                if (fp != NULL)
+                    touch_pages(p, 0, size);
 
                 total_size += size;
                 break;
@@ -1255,6 +1533,8 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 /* Remember region and size */
                 trace->blocks[index] = newp;
                 trace->block_sizes[index] = newsize;
+                if (fp != NULL && newsize > oldsize)
+                    touch_pages(newp, oldsize, newsize);
 
                 total_size += (newsize - oldsize);
                 break;
@@ -1274,6 +1554,37 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 total_size -= size;
                 break;
 
+            case ALLOC_BATCH: /* mm_malloc_batch */
+                index = trace->ops[i].index;
+                size = trace->ops[i].size;
+                n = trace->ops[i].count;
+                if (mm_malloc_batch(size, n, (void **)&trace->blocks[index]) != (size_t)n) {
+                    app_error("trace %d: mm_malloc_batch failed in eval_mm_util",
+                              tracenum);
+                }
+
+                /* Remember sizes */
+                for (j = index; j < index + n; j++) {
+                    trace->block_sizes[j] = size;
+                    if (fp != NULL)
+                        touch_pages(trace->blocks[j], 0, size);
+                }
+
+                total_size += n * size;
+                break;
+
+            case FREE_BATCH: /* mm_free_batch */
+                index = trace->ops[i].index;
+                n = trace->ops[i].count;
+                for (j = index; j < index + n; j++)
+                    total_size -= trace->block_sizes[j];
+
+                mm_free_batch((void **)&trace->blocks[index], n);
+                break;
+
+            case BARRIER: /* ordering point, nothing to do serially */
+                break;
+
             default:
                 app_error("trace %d: Nonexistent request type in eval_mm_util",
                           tracenum);
@@ -1282,9 +1593,30 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         /* update the high-water mark */
         max_total_size = (total_size > max_total_size) ?
             total_size : max_total_size;
-        heap_size = mem_heapsize();
+        heap_size = mem_heapsize() + mem_mapsize();
         max_heap_size = (heap_size > max_heap_size) ?
             heap_size : max_heap_size;
+
+        /* sample the resident pages, and the last op in any case */
+        if (fp != NULL && ((i + 1) % footprint_every == 0 ||
+                           i == trace->num_ops - 1)) {
+            rss = mem_residentsize();
+            max_rss = (rss > max_rss) ? rss : max_rss;
+            sum_total += total_size;
+            sum_heap += heap_size;
+            sum_rss += rss;
+            samples++;
+        }
+    }
+
+    if (fp != NULL) {
+        fp->every = footprint_every;
+        fp->live_peak = max_total_size;
+        fp->heap_peak = max_heap_size;
+        fp->rss_peak = max_rss;
+        fp->live_avg = samples == 0 ? 0 : sum_total / samples;
+        fp->heap_avg = samples == 0 ? 0 : sum_heap / samples;
+        fp->rss_avg = samples == 0 ? 0 : sum_rss / samples;
     }
 
 #if !REF_ONLY
@@ -1301,7 +1633,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index;
+    int i, index, n;
     size_t size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
@@ -1309,7 +1641,7 @@ static void eval_mm_speed(void *ptr)
 
     /* Reset the heap and initialize the mm package */
     mem_reset_brk();
-    if (!mm_init())
+    if (!init_mm())
         app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
@@ -1343,11 +1675,449 @@ static void eval_mm_speed(void *ptr)
                 mm_free(block);
                 break;
 
+            case ALLOC_BATCH: /* mm_malloc_batch */
+                index = trace->ops[i].index;
+                size = trace->ops[i].size;
+                n = trace->ops[i].count;
+                if (mm_malloc_batch(size, n, (void **)&trace->blocks[index]) != (size_t)n)
+                    app_error("mm_malloc_batch error in eval_mm_speed");
+                break;
+
+            case FREE_BATCH: /* mm_free_batch */
+                index = trace->ops[i].index;
+                mm_free_batch((void **)&trace->blocks[index], trace->ops[i].count);
+                break;
+
+            case BARRIER: /* ordering point, nothing to do serially */
+                break;
+
             default:
                 app_error("Nonexistent request type in eval_mm_speed");
         }
 }
 
+/*
+ * get_secs - Returns a monotonic timestamp in seconds
+ */
+static double get_secs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * replay_thread - Body of one replay thread in scaling mode. Waits at
+ *    the start barrier, then replays its share of the trace through the
+ *    mm package and records when it started and finished.
+ */
+static void *replay_thread(void *ptr)
+{
+    replay_t *r = (replay_t *)ptr;
+    trace_t *trace = r->trace;
+    int i, j, index;
+    size_t size;
+    char *p, *newp;
+
+    pthread_barrier_wait(r->barrier);
+    r->start = get_secs();
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        index = trace->ops[i].index;
+        if (trace->ops[i].type == BARRIER)
+            continue;
+        /* a batch is split between the slices, one request per id */
+        if (r->slice && trace->ops[i].count > 1) {
+            for (j = index; j < index + trace->ops[i].count; j++) {
+                if (j % r->nthreads != r->tid)
+                    continue;
+                r->ops++;
+                if (trace->ops[i].type == FREE_BATCH) {
+                    mm_free(r->blocks[j]);
+                } else if ((r->blocks[j] = mm_malloc(trace->ops[i].size)) == NULL) {
+                    app_error("mm_malloc error in replay_thread");
+                }
+            }
+            continue;
+        }
+        /* free(NULL) belongs to the first slice */
+        if (r->slice && (index < 0 ? 0 : index) % r->nthreads != r->tid)
+            continue;
+        r->ops += trace->ops[i].count;
+        switch (trace->ops[i].type) {
+
+            case ALLOC: /* mm_malloc */
+                size = trace->ops[i].size;
+                if ((p = mm_malloc(size)) == NULL)
+                    app_error("mm_malloc error in replay_thread");
+                r->blocks[index] = p;
+                break;
+
+            case REALLOC: /* mm_realloc */
+                size = trace->ops[i].size;
+                if ((newp = mm_realloc(r->blocks[index], size)) == NULL && size != 0)
+                    app_error("mm_realloc error in replay_thread");
+                r->blocks[index] = newp;
+                break;
+
+            case FREE: /* mm_free */
+                mm_free(index < 0 ? NULL : r->blocks[index]);
+                break;
+
+            case ALLOC_BATCH: /* mm_malloc_batch */
+                size = trace->ops[i].size;
+                if (mm_malloc_batch(size, trace->ops[i].count, (void **)&r->blocks[index]) !=
+                    (size_t)trace->ops[i].count)
+                    app_error("mm_malloc_batch error in replay_thread");
+                break;
+
+            case FREE_BATCH: /* mm_free_batch */
+                mm_free_batch((void **)&r->blocks[index], trace->ops[i].count);
+                break;
+
+            default:
+                app_error("Nonexistent request type in replay_thread");
+        }
+    }
+
+    r->end = get_secs();
+    return NULL;
+}
+
+/*
+ * eval_mm_scale - Replays a trace on nthreads threads at once, all
+ *    released by one barrier. Each thread runs its own copy of the
+ *    trace, or with slice set, the requests for its own share of the
+ *    ids. The aggregate throughput counts every request from the first
+ *    start to the last finish.
+ */
+static void eval_mm_scale(trace_t *trace, int nthreads, bool slice,
+                          scale_stats_t *stats)
+{
+    int t;
+    long ops = 0;
+    double first = DBL_MAX, last = 0, tput;
+    pthread_barrier_t barrier;
+    pthread_t *tids;
+    replay_t *replays;
+
+    tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    replays = (replay_t *)calloc(nthreads, sizeof(replay_t));
+    if (tids == NULL || replays == NULL)
+        unix_error("calloc in eval_mm_scale failed");
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (!init_mm())
+        app_error("mm_init failed in eval_mm_scale");
+
+    if (pthread_barrier_init(&barrier, NULL, nthreads) != 0)
+        app_error("pthread_barrier_init failed in eval_mm_scale");
+    for (t = 0; t < nthreads; t++) {
+        replays[t].trace = trace;
+        replays[t].tid = t;
+        replays[t].nthreads = nthreads;
+        replays[t].slice = slice;
+        replays[t].barrier = &barrier;
+        replays[t].blocks = (char **)calloc(trace->num_ids, sizeof(char *));
+        if (replays[t].blocks == NULL)
+            unix_error("blocks calloc in eval_mm_scale failed");
+        if (pthread_create(&tids[t], NULL, replay_thread, &replays[t]) != 0)
+            app_error("pthread_create failed in eval_mm_scale");
+    }
+
+    stats->min_tput = DBL_MAX;
+    stats->avg_tput = 0;
+    stats->max_tput = 0;
+    for (t = 0; t < nthreads; t++) {
+        pthread_join(tids[t], NULL);
+        tput = replays[t].ops / (replays[t].end - replays[t].start) * 0.001;
+        stats->min_tput = fmin(stats->min_tput, tput);
+        stats->max_tput = fmax(stats->max_tput, tput);
+        stats->avg_tput += tput / nthreads;
+        first = fmin(first, replays[t].start);
+        last = fmax(last, replays[t].end);
+        ops += replays[t].ops;
+        free(replays[t].blocks);
+    }
+    stats->agg_tput = ops / (last - first) * 0.001;
+
+    pthread_barrier_destroy(&barrier);
+    free(replays);
+    free(tids);
+}
+
+/*
+ * print_scaling - Prints the scaling curve of one trace for 1..scale_max
+ *    threads, next to the single-thread throughput measured by fcyc.
+ *    Each thread count keeps the best of SCALE_REPS runs.
+ */
+static void print_scaling(const stats_t *stats, trace_t *trace)
+{
+    int n, rep;
+    double base = 0;
+    scale_stats_t best, cur;
+
+    printf("\nScaling for %s (%s, single thread %.0f Kops/s):\n",
+           stats->filename, scale_slice ? "slices" : "copies",
+           stats->secs == 0 ? 0 : stats->ops / stats->secs * 0.001);
+    printf("%7s %12s %8s %10s %10s %10s\n", "threads", "agg Kops/s",
+           "speedup", "min Kops/s", "avg Kops/s", "max Kops/s");
+
+    for (n = 1; n <= scale_max; n++) {
+        eval_mm_scale(trace, n, scale_slice, &best);
+        for (rep = 1; rep < SCALE_REPS; rep++) {
+            eval_mm_scale(trace, n, scale_slice, &cur);
+            if (cur.agg_tput > best.agg_tput)
+                best = cur;
+        }
+        if (n == 1)
+            base = best.agg_tput;
+        printf("%7d %12.0f %8.2f %10.0f %10.0f %10.0f\n", n, best.agg_tput,
+               best.agg_tput / base, best.min_tput, best.avg_tput,
+               best.max_tput);
+    }
+}
+
+/*
+ * print_footprint - Prints the resident-set figures that eval_mm_util
+ *    collected for a trace: payload, heap, and resident bytes at their
+ *    peak and averaged over the samples, with payload / resident.
+ */
+static void print_footprint(const stats_t *stats, const footprint_t *fp)
+{
+    printf("\nFootprint for %s (resident pages sampled every %d ops):\n",
+           stats->filename, fp->every);
+    printf("%5s %12s %12s %12s %9s\n", "", "live KB", "heap KB",
+           "RSS KB", "live/RSS");
+    printf("%5s %12.0f %12.0f %12.0f %8.1f%%\n", "peak",
+           fp->live_peak / 1024, fp->heap_peak / 1024, fp->rss_peak / 1024,
+           fp->rss_peak == 0 ? 0 : fp->live_peak / fp->rss_peak * 100.0);
+    printf("%5s %12.0f %12.0f %12.0f %8.1f%%\n", "avg",
+           fp->live_avg / 1024, fp->heap_avg / 1024, fp->rss_avg / 1024,
+           fp->rss_avg == 0 ? 0 : fp->live_avg / fp->rss_avg * 100.0);
+}
+
+/*
+ * print_walk - Times the trace with prefetching in the list walks of the
+ *    mm package turned off and on, and prints the cycles per op of both
+ *    along with the list nodes a run looks at. The difference per node
+ *    is what prefetching saves on each step of a walk.
+ */
+static void print_walk(const stats_t *stats, speed_t *speed_params)
+{
+    double cyc_off, cyc_on, nodes;
+
+    walk_prefetch = false;
+    cyc_off = fcyc(eval_mm_speed, speed_params);
+    nodes = (double)mm_list_nodes();
+    walk_prefetch = true;
+    if (!mm_set_prefetch(true)) {
+        printf("\nList walks for %s: mm.c was built without prefetch\n",
+               stats->filename);
+        return;
+    }
+    cyc_on = fcyc(eval_mm_speed, speed_params);
+
+    printf("\nList walks for %s:\n", stats->filename);
+    printf("%12s %12s %14s %14s %16s\n", "nodes", "nodes/op",
+           "cyc/op off", "cyc/op on", "cyc/node saved");
+    printf("%12.0f %12.3f %14.1f %14.1f", nodes, nodes / stats->ops,
+           cyc_off / stats->ops, cyc_on / stats->ops);
+    if (nodes > 0)
+        printf(" %16.1f\n", (cyc_off - cyc_on) / nodes);
+    else
+        printf(" %16s\n", "-");
+}
+
+/*
+ * trace_thread - Body of one thread in threaded replay. Replays the
+ *    requests that the trace gives to this thread, in file order. A
+ *    request on a block last touched by another thread first waits
+ *    until that request is done, and a barrier waits for every thread,
+ *    so each run sees the same cross-thread ordering.
+ */
+static void *trace_thread(void *ptr)
+{
+    replay_t *r = (replay_t *)ptr;
+    trace_t *trace = r->trace;
+    traceop_t *op;
+    int i, dep;
+    bool remote;
+    double t0;
+    char *p, *newp;
+
+    pthread_barrier_wait(r->barrier);
+    r->start = get_secs();
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        op = &trace->ops[i];
+        if (op->type == BARRIER) {
+            t0 = get_secs();
+            pthread_barrier_wait(r->barrier);
+            r->wait += get_secs() - t0;
+            continue;
+        }
+        if (op->thread != r->tid)
+            continue;
+
+        dep = op->dep;
+        if (dep >= 0 && !__atomic_load_n(&r->done[dep], __ATOMIC_ACQUIRE)) {
+            t0 = get_secs();
+            while (!__atomic_load_n(&r->done[dep], __ATOMIC_ACQUIRE))
+                sched_yield();
+            r->wait += get_secs() - t0;
+        }
+
+        r->ops += op->count;
+        switch (op->type) {
+
+            case ALLOC: /* mm_malloc */
+                if ((p = mm_malloc(op->size)) == NULL)
+                    app_error("mm_malloc error in trace_thread");
+                r->blocks[op->index] = p;
+                break;
+
+            case REALLOC: /* mm_realloc */
+                newp = mm_realloc(r->blocks[op->index], op->size);
+                if (newp == NULL && op->size != 0)
+                    app_error("mm_realloc error in trace_thread");
+                r->blocks[op->index] = newp;
+                break;
+
+            case FREE: /* mm_free, timed separately for local and remote blocks */
+                remote = dep >= 0;
+                t0 = get_secs();
+                mm_free(op->index < 0 ? NULL : r->blocks[op->index]);
+                r->free_secs[remote] += get_secs() - t0;
+                r->frees[remote]++;
+                break;
+
+            case ALLOC_BATCH: /* mm_malloc_batch */
+                if (mm_malloc_batch(op->size, op->count, (void **)&r->blocks[op->index]) !=
+                    (size_t)op->count)
+                    app_error("mm_malloc_batch error in trace_thread");
+                break;
+
+            case FREE_BATCH: /* mm_free_batch, its blocks are always local */
+                t0 = get_secs();
+                mm_free_batch((void **)&r->blocks[op->index], op->count);
+                r->free_secs[0] += get_secs() - t0;
+                r->frees[0] += op->count;
+                break;
+
+            default:
+                app_error("Nonexistent request type in trace_thread");
+        }
+        __atomic_store_n(&r->done[i], 1, __ATOMIC_RELEASE);
+    }
+
+    r->end = get_secs();
+    return NULL;
+}
+
+/*
+ * eval_mm_threaded - Replays an annotated trace with one thread per
+ *    thread named in the trace, all sharing trace->blocks. The results
+ *    of each thread are left in replays[].
+ */
+static void eval_mm_threaded(trace_t *trace, replay_t *replays)
+{
+    int t, nthreads = trace->num_threads;
+    pthread_barrier_t barrier;
+    pthread_t *tids;
+    char *done;
+
+    tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    done = (char *)calloc(trace->num_ops, sizeof(char));
+    if (tids == NULL || done == NULL)
+        unix_error("calloc in eval_mm_threaded failed");
+
+    /* Reset the heap and initialize the mm package */
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!init_mm())
+        app_error("mm_init failed in eval_mm_threaded");
+
+    if (pthread_barrier_init(&barrier, NULL, nthreads) != 0)
+        app_error("pthread_barrier_init failed in eval_mm_threaded");
+    memset(replays, 0, nthreads * sizeof(replay_t));
+    for (t = 0; t < nthreads; t++) {
+        replays[t].trace = trace;
+        replays[t].tid = t;
+        replays[t].nthreads = nthreads;
+        replays[t].blocks = trace->blocks;
+        replays[t].barrier = &barrier;
+        replays[t].done = done;
+        if (pthread_create(&tids[t], NULL, trace_thread, &replays[t]) != 0)
+            app_error("pthread_create failed in eval_mm_threaded");
+    }
+    for (t = 0; t < nthreads; t++)
+        pthread_join(tids[t], NULL);
+
+    pthread_barrier_destroy(&barrier);
+    free(done);
+    free(tids);
+}
+
+/*
+ * print_threaded - Prints the results of replaying an annotated trace on
+ *    its own threads: aggregate throughput, the share of thread time
+ *    spent waiting on ordering, and the mean cost of local and remote
+ *    frees. Keeps the best of SCALE_REPS runs.
+ */
+static void print_threaded(const stats_t *stats, trace_t *trace)
+{
+    int t, rep, nthreads = trace->num_threads;
+    long ops, frees[2];
+    double first, last, busy, wait, free_secs[2];
+    double tput, best_tput = -1, best_wait = 0;
+    double best_free[2] = {0, 0};
+    replay_t *replays;
+
+    replays = (replay_t *)calloc(nthreads, sizeof(replay_t));
+    if (replays == NULL)
+        unix_error("calloc in print_threaded failed");
+
+    for (rep = 0; rep < SCALE_REPS; rep++) {
+        eval_mm_threaded(trace, replays);
+        ops = 0;
+        first = DBL_MAX;
+        last = busy = wait = 0;
+        frees[0] = frees[1] = 0;
+        free_secs[0] = free_secs[1] = 0;
+        for (t = 0; t < nthreads; t++) {
+            ops += replays[t].ops;
+            first = fmin(first, replays[t].start);
+            last = fmax(last, replays[t].end);
+            busy += replays[t].end - replays[t].start;
+            wait += replays[t].wait;
+            frees[0] += replays[t].frees[0];
+            frees[1] += replays[t].frees[1];
+            free_secs[0] += replays[t].free_secs[0];
+            free_secs[1] += replays[t].free_secs[1];
+        }
+        tput = ops / (last - first) * 0.001;
+        if (tput > best_tput) {
+            best_tput = tput;
+            best_wait = busy == 0 ? 0 : wait / busy;
+            best_free[0] = frees[0] == 0 ? 0 : free_secs[0] / frees[0] * 1e9;
+            best_free[1] = frees[1] == 0 ? 0 : free_secs[1] / frees[1] * 1e9;
+        }
+    }
+
+    printf("\nThreaded replay of %s: %d threads, %d remote frees\n",
+           stats->filename, nthreads, trace->num_remote);
+    printf("%12.0f Kops/s aggregate (single thread %.0f Kops/s)\n", best_tput,
+           stats->secs == 0 ? 0 : stats->ops / stats->secs * 0.001);
+    printf("%11.1f%% of thread time waiting on ordering\n", best_wait * 100.0);
+    printf("%12.0f ns per local free, %.0f ns per remote free\n",
+           best_free[0], best_free[1]);
+
+    free(replays);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1356,7 +2126,7 @@ static void eval_mm_speed(void *ptr)
  */
 static bool eval_libc_valid(trace_t *trace)
 {
-    int i;
+    int i, j;
     size_t newsize;
     char *p, *newp, *oldp;
 
@@ -1391,6 +2161,24 @@ static bool eval_libc_valid(trace_t *trace)
                 }
                 break;
 
+            case ALLOC_BATCH: /* one malloc per id, libc has no batches */
+                for (j = trace->ops[i].index; j < trace->ops[i].index + trace->ops[i].count; j++) {
+                    if ((p = malloc(trace->ops[i].size)) == NULL) {
+                        malloc_error(trace, i, "libc malloc failed");
+                        unix_error("System message");
+                    }
+                    trace->blocks[j] = p;
+                }
+                break;
+
+            case FREE_BATCH: /* one free per id */
+                for (j = trace->ops[i].index; j < trace->ops[i].index + trace->ops[i].count; j++)
+                    free(trace->blocks[j]);
+                break;
+
+            case BARRIER: /* ordering point, nothing to do serially */
+                break;
+
             default:
                 app_error("invalid operation type  in eval_libc_valid");
         }
@@ -1406,7 +2194,7 @@ static bool eval_libc_valid(trace_t *trace)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
+    int i, j;
     int index;
     size_t size, newsize;
     char *p, *newp, *oldp, *block;
@@ -1443,6 +2231,23 @@ static void eval_libc_speed(void *ptr)
                     free(0);
                 }
                 break;
+
+            case ALLOC_BATCH: /* one malloc per id, libc has no batches */
+                index = trace->ops[i].index;
+                size = trace->ops[i].size;
+                for (j = index; j < index + trace->ops[i].count; j++)
+                    if ((trace->blocks[j] = malloc(size)) == NULL)
+                        unix_error("malloc failed in eval_libc_speed");
+                break;
+
+            case FREE_BATCH: /* one free per id */
+                index = trace->ops[i].index;
+                for (j = index; j < index + trace->ops[i].count; j++)
+                    free(trace->blocks[j]);
+                break;
+
+            case BARRIER: /* ordering point, nothing to do serially */
+                break;
         }
     }
 }
@@ -1828,7 +2633,7 @@ static double measure_ref_throughput() {
  */
 static void usage(char *prog)
 {
-    fprintf(stderr, "Usage: %s [-hlVdD] [-f <file>]\n", prog);
+    fprintf(stderr, "Usage: %s [-hlVdDSW] [-f <file>] [-F <fit>] [-P <n>] [-R <n>]\n", prog);
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
@@ -1841,4 +2646,9 @@ static void usage(char *prog)
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-F <fit>   Fit policy: first (default), best, next, good, or address\n");
+    fprintf(stderr, "\t-P <n>     Also replay each trace on 1..n threads (0: one per core)\n");
+    fprintf(stderr, "\t-S         With -P, split the trace between threads instead of copying it\n");
+    fprintf(stderr, "\t-R <n>     Also report resident heap pages, sampled every n ops\n");
+    fprintf(stderr, "\t-W         Also report the cycles list prefetching saves per node\n");
 }
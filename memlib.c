@@ -18,30 +18,59 @@
 #include "memlib.h"
 #include "config.h"
 
+/* The upper half of the reserved space holds the emulated mappings */
+#define MAP_AREA_SIZE (MAX_HEAP_SIZE / 2)
+
+/* Pages whose residency mincore reports per call */
+#define RESIDENT_CHUNK 4096
+
 /* private global variables */
 static unsigned char *heap;                 /* Starting address of heap */
 static unsigned char *mem_brk;              /* Current position of break */
 static unsigned char *mem_max_addr;         /* Maximum allowable heap address */
+static unsigned char *map_area;             /* Starting address of the mapping area */
+static unsigned char *map_brk;              /* First address never handed out by mm_mmap */
+static size_t map_bytes;                    /* Bytes currently mapped by mm_mmap */
 
 /* 
  * mm_sbrk - simple model of the sbrk function. Extends the heap 
  *           by incr bytes and returns the start address of the
- *           new area. In this model, the heap cannot be shrunk.
+ *           new area, i.e., the old break. A negative incr shrinks
+ *           the heap and gives the whole pages above the new break
+ *           back to the system; their contents are lost.
+ *           Safe to call from several threads at once: each caller
+ *           claims its area with a compare and swap on the break. A
+ *           caller that shrinks the heap must make sure no other
+ *           thread extends it at the same time.
  */
 void *mm_sbrk(intptr_t incr) {
-    unsigned char *old_brk = mem_brk;
+    unsigned char *old_brk = __atomic_load_n(&mem_brk, __ATOMIC_RELAXED);
 
     bool ok = true;
-    if (incr < 0) {
-	ok = false;
-	fprintf(stderr, "ERROR: mm_sbrk failed.  Attempt to expand heap by negative value %ld\n", (long) incr);
-    } else if (mem_brk + incr > mem_max_addr) {
-	ok = false;
-	long alloc = mem_brk - heap + incr;
-	fprintf(stderr, "ERROR: mm_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
+    do {
+	if (incr < 0 && old_brk - heap < -incr) {
+	    ok = false;
+	    fprintf(stderr, "ERROR: mm_sbrk failed.  Attempt to shrink heap of %zd bytes by %ld\n",
+		    (size_t)(old_brk - heap), (long) -incr);
+	    break;
+	}
+	if (old_brk + incr > mem_max_addr) {
+	    ok = false;
+	    long alloc = old_brk - heap + incr;
+	    fprintf(stderr, "ERROR: mm_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
+	    break;
+	}
+    } while (!__atomic_compare_exchange_n(&mem_brk, &old_brk, old_brk + incr, true,
+					  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    if (ok && incr < 0) {
+	size_t page = mm_pagesize();
+	uintptr_t lo = ((uintptr_t) (old_brk + incr) + page - 1) & ~(page - 1);
+	uintptr_t hi = ((uintptr_t) old_brk + page - 1) & ~(page - 1);
+	if (lo < hi && madvise((void *) lo, hi - lo, MADV_DONTNEED) != 0) {
+	    fprintf(stderr, "ERROR: mm_sbrk failed.  %s\n", strerror(errno));
+	}
     }
     if (ok) {
-	mem_brk += incr;
 	return (void *) old_brk;
     } else {
 	errno = ENOMEM;
@@ -49,6 +78,82 @@ void *mm_sbrk(intptr_t incr) {
     }
 }
 
+/*
+ * mm_mmap - simple model of an anonymous mmap. Returns a fresh, zeroed,
+ *           page-aligned area of len bytes (rounded up to whole pages),
+ *           outside the heap. In this model, address space is handed
+ *           out in increasing order and only reused after a reset.
+ *           Safe to call from several threads at once.
+ */
+void *mm_mmap(size_t len) {
+    size_t page = mm_pagesize();
+    unsigned char *old_brk = __atomic_load_n(&map_brk, __ATOMIC_RELAXED);
+
+    len = (len + page - 1) & ~(page - 1);
+    do {
+	if (len == 0 || len > (size_t)(map_area + MAP_AREA_SIZE - old_brk)) {
+	    fprintf(stderr, "ERROR: mm_mmap failed.  Cannot map %zu (0x%zx) bytes\n", len, len);
+	    errno = ENOMEM;
+	    return (void *) -1;
+	}
+    } while (!__atomic_compare_exchange_n(&map_brk, &old_brk, old_brk + len, true,
+					  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&map_bytes, len, __ATOMIC_RELAXED);
+    return (void *) old_brk;
+}
+
+/*
+ * mm_munmap - simple model of munmap. Releases the pages of
+ *             [addr, addr + len), which must be page aligned and lie in
+ *             an area returned by mm_mmap. The pages are given back to
+ *             the system and any later access to them faults.
+ */
+int mm_munmap(void *addr, size_t len) {
+    size_t page = mm_pagesize();
+    unsigned char *p = (unsigned char *) addr;
+
+    len = (len + page - 1) & ~(page - 1);
+    if (((uintptr_t) p & (page - 1)) != 0 || p < map_area ||
+	p + len > __atomic_load_n(&map_brk, __ATOMIC_ACQUIRE)) {
+	fprintf(stderr, "ERROR: mm_munmap failed.  Area %p:%p was not mapped\n",
+		p, p + len);
+	errno = EINVAL;
+	return -1;
+    }
+    if (madvise(p, len, MADV_DONTNEED) != 0 ||
+	mprotect(p, len, PROT_NONE) != 0) {
+	fprintf(stderr, "ERROR: mm_munmap failed.  %s\n", strerror(errno));
+	return -1;
+    }
+    __atomic_sub_fetch(&map_bytes, len, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * mm_madvise - simple model of the madvise function, limited to the
+ *              heap. [addr, addr + len) must be page aligned and lie
+ *              below the break. With MADV_DONTNEED, the pages are
+ *              given back to the system and read as zero the next
+ *              time they are touched.
+ */
+int mm_madvise(void *addr, size_t len, int advice) {
+    size_t page = mm_pagesize();
+    unsigned char *p = (unsigned char *) addr;
+
+    if (((uintptr_t) p & (page - 1)) != 0 || (len & (page - 1)) != 0 ||
+	p < heap || p + len > __atomic_load_n(&mem_brk, __ATOMIC_ACQUIRE)) {
+	fprintf(stderr, "ERROR: mm_madvise failed.  Area %p:%p is not whole heap pages\n",
+		p, p + len);
+	errno = EINVAL;
+	return -1;
+    }
+    if (madvise(p, len, advice) != 0) {
+	fprintf(stderr, "ERROR: mm_madvise failed.  %s\n", strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
 /*
  * mm_heap_lo - return address of the first heap byte
  */
@@ -60,14 +165,14 @@ void *mm_heap_lo(){
  * mm_heap_hi - return address of last heap byte
  */
 void *mm_heap_hi(){
-    return (void *)(mem_brk - 1);
+    return (void *)(__atomic_load_n(&mem_brk, __ATOMIC_ACQUIRE) - 1);
 }
 
 /*
  * mm_heapsize - returns the heap size in bytes
  */
 size_t mm_heapsize() {
-    return (size_t)(mem_brk - heap);
+    return (size_t)(__atomic_load_n(&mem_brk, __ATOMIC_ACQUIRE) - heap);
 }
 
 /*
@@ -137,7 +242,9 @@ void mem_init(){
 	exit(1);
     }
     heap = addr;
-    mem_max_addr = addr + MAX_HEAP_SIZE;
+    mem_max_addr = addr + MAX_HEAP_SIZE - MAP_AREA_SIZE;
+    map_area = mem_max_addr;
+    map_brk = map_area;
     mem_reset_brk();
 }
 
@@ -152,10 +259,31 @@ void mem_deinit(void){
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *                 and drop every mapping made by mm_mmap
  */
 void mem_reset_brk(){
     mem_brk = heap;
+    if (map_brk != map_area) {
+	if (mprotect(map_area, map_brk - map_area, PROT_READ | PROT_WRITE) != 0 ||
+	    madvise(map_area, map_brk - map_area, MADV_DONTNEED) != 0) {
+	    fprintf(stderr, "FAILURE.  Couldn't reset the mapping area\n");
+	    exit(1);
+	}
+    }
+    map_brk = map_area;
+    map_bytes = 0;
+}
+
+/*
+ * mem_decommit - give the pages of the heap below the break back to the
+ *                system, so that the next run starts with nothing resident
+ */
+void mem_decommit(void){
+    if (mem_brk != heap && madvise(heap, mem_brk - heap, MADV_DONTNEED) != 0) {
+        fprintf(stderr, "FAILURE.  Couldn't decommit the heap\n");
+        exit(1);
+    }
 }
 
 void *mem_sbrk(intptr_t incr) {
@@ -174,19 +302,62 @@ size_t mem_heapsize() {
     return (size_t)(mem_brk - heap);
 }
 
+void *mem_map_lo(){
+    return (void *) map_area;
+}
+
+void *mem_map_hi(){
+    return (void *)(map_brk - 1);
+}
+
+size_t mem_mapsize() {
+    return __atomic_load_n(&map_bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * resident_bytes - bytes of [lo, hi) that are resident, as told by mincore
+ */
+static size_t resident_bytes(unsigned char *lo, unsigned char *hi) {
+    size_t page = (size_t) getpagesize();
+    unsigned char vec[RESIDENT_CHUNK];
+    size_t resident = 0;
+    while (lo < hi) {
+        size_t pages = ((size_t)(hi - lo) + page - 1) / page;
+        size_t i;
+        if (pages > RESIDENT_CHUNK)
+            pages = RESIDENT_CHUNK;
+        if (mincore(lo, pages * page, vec) != 0) {
+            fprintf(stderr, "FAILURE.  mincore couldn't read the heap\n");
+            exit(1);
+        }
+        for (i = 0; i < pages; i++)
+            resident += vec[i] & 1;
+        lo += pages * page;
+    }
+    return resident * page;
+}
+
+/*
+ * mem_residentsize - bytes of the heap and of the mappings that are
+ *                    resident, i.e. were touched and not given back
+ */
+size_t mem_residentsize() {
+    return resident_bytes(heap, mem_brk) + resident_bytes(map_area, map_brk);
+}
+
 size_t mem_pagesize(){
     return (size_t) getpagesize();
 }
 
 /* Read len bytes and return value zero-extended to 64 bits */
 uint64_t mem_read(const void *addr, size_t len) {
-    uint64_t rdata;
-    /* Dense or non-heap read */
-    rdata = *(uint64_t *) addr;
-    if (len < sizeof(uint64_t)) {
-	uint64_t mask = ((uint64_t) 1 << (8 * len)) - 1;
-	rdata &= mask;
-    }
+    uint64_t rdata = 0;
+    /* Dense or non-heap read, never past addr + len: the last page of
+       a mapping may be followed by an unmapped one */
+    if (len == sizeof(uint64_t))
+        rdata = *(uint64_t *) addr;
+    else
+        memcpy((void *) &rdata, addr, len);
     return rdata;
 }
 
@@ -9,6 +9,9 @@ void *mm_heap_lo(void);
 void *mm_heap_hi(void);
 size_t mm_heapsize(void);
 size_t mm_pagesize(void);
+void *mm_mmap(size_t len);
+int mm_munmap(void *addr, size_t len);
+int mm_madvise(void *addr, size_t len, int advice);
 void *mm_memcpy(void *dst, const void *src, size_t n);
 void *mm_memset(void *dst, int c, size_t n);
 
@@ -19,9 +22,14 @@ void mem_init();
 void mem_deinit(void);
 void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
+void mem_decommit(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+void *mem_map_lo(void);
+void *mem_map_hi(void);
+size_t mem_mapsize(void);
+size_t mem_residentsize(void);
 size_t mem_pagesize(void);
 
 /* Read len bytes and return value zero-extended to 64 bits */
@@ -3,20 +3,37 @@
  *
  * Name: Yufeng Zhang
  *
- * - Segregated free list (9 roots, see pick_root() for details)
- * - First fit
+ * A malloc package for multi-threaded programs. Requests up to SLAB_MAX
+ * bytes are served from slab runs of equal slots, bigger ones from a
+ * two-level segregated fit (TLSF) matrix of free lists, backed by a splay
+ * tree for large free blocks, and requests of MMAP_THRESHOLD bytes and up
+ * get a mapping of their own. Every thread allocates from its own arena
+ * and keeps a small cache of freed slots; blocks freed by other threads go
+ * back to their arena through its remote list.
+ *
  * - Coalescing
  * - Splitting
- * - Sorted free list
- * 
+ * - LIFO insertion: under the default first fit, malloc and free of blocks
+ *   below LARGE_MIN run in constant time. The large tree takes O(log n)
+ *   amortized, the other fit policies walk a list, address ordered
+ *   insertion walks one too, and draining a remote list is linear in its
+ *   length
+ *
  */
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -45,6 +62,9 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define aligned_alloc mm_aligned_alloc
+#define posix_memalign mm_posix_memalign
 #define memset mm_memset
 #define memcpy mm_memcpy
 #endif // DRIVER
@@ -55,37 +75,317 @@
 #define WSIZE 8  // Word and header/footer size (bytes)
 #define DSIZE 16 // Double word size (bytes)
 
-static char *heap_listp; // Pointer to beginning of heap
-static char *root_array[9] = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+// Header bits. Allocated blocks have a header only, no footer. PREV_ALLOC
+// records whether the previous block is allocated, so coalesce reads the
+// previous footer only when that block is free
+#define ALLOC 1      // block is allocated
+#define PREV_ALLOC 2 // previous block is allocated
+#define DECOMMITTED 8 // free block's interior pages are decommitted
+
+#define OWNER_SHIFT 48                                                    // arena index sits above the size
+#define SIZE_MASK ((((uint64_t)1 << OWNER_SHIFT) - 1) & ~(uint64_t)0xf) // size bits of a header
+
+#define MIN_BLOCK_SIZE (2 * DSIZE) // header, prev and next ptr and footer, the smallest block there is
+
+// TLSF parameters. Free blocks are kept in a matrix of FL_INDEX_COUNT x
+// SL_INDEX_COUNT lists. Size classes are log-linear: the first level picks
+// a power of two, the second level splits it into SL_INDEX_COUNT equal
+// ranges, the smallest sizes are classed linearly by the same clz formula
+// (see mapping_insert()). Two bitmaps record which lists are non-empty, so
+// finding a fit is a pair of find-first-set operations, not a list walk
+#define ALIGN_SHIFT 4                                       // log2(ALIGNMENT)
+#define SL_INDEX_BITS 2                                     // log2 of second level lists per power of two
+#define SL_INDEX_COUNT (1 << SL_INDEX_BITS)                 // second level lists per first level
+#define UNITS_MAX_BITS 36                                   // heap is at most 1TB = 2^36 units of ALIGNMENT
+#define FL_INDEX_COUNT (UNITS_MAX_BITS - SL_INDEX_BITS + 1) // first level lists
+#define CLASS_COUNT (FL_INDEX_COUNT * SL_INDEX_COUNT)       // number of free lists
+
+// Fit parameters. find_free_list and insert_free switch on the fit policy
+// of the arena: first fit (default), best fit, next fit with a roving ptr,
+// good fit (best of the first FIT_CANDIDATES) and first fit over address
+// ordered lists. First fit rounds the request up to the next class
+// boundary, so the head of any non-empty class the bitmaps find is big
+// enough. Free blocks of LARGE_MIN bytes or more are kept in a splay tree
+// per arena instead, keyed by size and address, so the best fit for a big
+// request takes O(log n) amortized
+#define FIT_CANDIDATES 8     // good fit: blocks that fit looked at before taking the smallest
+#define LARGE_MIN (16 * 1024) // free blocks from this size up go in the large tree, not the lists
+
+// Prefetch parameters. A walk along a list loads the next node's link
+// words and header while it tests the current node, so the two misses per
+// node overlap the work instead of following it
+#ifndef PREFETCH
+#define PREFETCH 1 // build with -DPREFETCH=0 to walk lists without prefetches
+#endif
+
+// Fit vector parameters. For the policies that walk a list, each class
+// below LARGE_MIN mirrors the sizes and addresses of its blocks in a fit
+// vector while it holds at most VECTOR_SLOTS blocks, so a fit check over
+// the class is a single compare (AVX2 when built with it) instead of a
+// pointer chase per block. Longer lists are walked as before
+#define VECTOR_SLOTS 8                          // blocks a fit vector mirrors, 8 x 32 bits is one AVX2 compare
+#define VECTOR_CLASS_COUNT (9 * SL_INDEX_COUNT) // classes with a fit vector, first levels 0..8 cover every size below LARGE_MIN
+
+// Slab parameters. Slab runs are page-sized allocated blocks of equal
+// slots, one slot size per slab class. Slots carry no header, a bitmap in
+// the run header records the free ones. free finds the run of a pointer
+// through a radix tree keyed by page number (the page map), an unmapped
+// page means the pointer belongs to a regular block
+#define SLAB_MAX 512                                 // largest request served from a slab run
+#define SLAB_CLASS_COUNT 16                          // 16..128 by 16, 160..256 by 32, 320..512 by 64
+#define PAGE_SHIFT 12                                // log2 of the page size
+#define PAGE_SIZE (1 << PAGE_SHIFT)                  // a run takes one page
+#define RUN_MAP_WORDS 4                              // free slot bitmap, up to 256 slots per run
+#define PAGE_MAP_BITS 7                              // bits of the page number per radix level
+#define PAGE_MAP_FANOUT (1 << PAGE_MAP_BITS)         // entries per page map node
+#define PAGE_MAP_LEVELS 4                            // 4 x 7 bits cover 2^28 pages = 1TB of heap
+
+// header of a slab run, the slots follow it in the same page
+typedef struct slab_run
+{
+    struct slab_run *prev;           // prev run of this class with free slots
+    struct slab_run *next;           // next run of this class with free slots
+    uint32_t slot_size;              // size of every slot in the run
+    uint16_t slot_count;             // number of slots in the run
+    uint16_t free_count;             // number of free slots in the run
+    uint32_t slab_class;             // slab class of the run
+    uint64_t free_map[RUN_MAP_WORDS]; // bit i set if slot i is free
+} slab_run;
+
+// Large object parameters. Large blocks lie above the heap, so free tells
+// them apart by address alone and unmaps them at once, realloc shrinks
+// them by unmapping the tail pages
+#define MMAP_THRESHOLD (128 * 1024) // requests from this size up get a mapping of their own
+#define MAP_OFFSET DSIZE            // payload offset in a mapping, the header sits right before it
+
+// Trim parameters. The free block at the end of an arena's last chunk is
+// its top. It is kept out of the lists and only used when no list fits,
+// so it stays whole for growing in place, realloc at the end and trimming.
+// Once a free or a shrinking realloc grows the top at brk to
+// trim_threshold bytes, brk shrinks to keep TRIM_PAD bytes of it. Every
+// move of brk happens under the brk lock of the arena table, so an arena
+// never cuts into space another arena just claimed
+#define TRIM_THRESHOLD (256 * 1024) // default size of a free block at the end of the heap that makes free trim
+#define TRIM_PAD (128 * 1024)        // bytes free keeps at the end of the heap when it trims
+
+// Growth parameters. A malloc that no free block fits grows the heap by a
+// share of its size, up to a cap, the surplus stays in the top for the
+// next misses
+#define GROWTH_PERCENT 25         // default share of the heap size a miss grows the heap by
+#define GROWTH_MAX (16 * 1024)    // default cap on such a step, all of it may stay unused
+
+// Decommit parameters. Every DECOMMIT_AGE frees, big free blocks that
+// stayed free that long give the pages between their list ptrs and their
+// footer back with madvise, so a heap that shrinks and grows again doesn't
+// fault its pages back in each time. DECOMMITTED marks them so they are
+// not done twice, the remainder of a split keeps the mark, a merge makes a
+// new block without it
+#define DECOMMIT_MIN (128 * 1024) // free blocks from this size up give their interior pages back
+#define DECOMMIT_AGE 1024         // ... once they stayed free for this many calls of free_block
+
+// Arena parameters. Every thread is attached to an arena with its own
+// lists, lock and chunks of heap. A chunk is a run of blocks between its
+// own prologue and epilogue, it grows in place while no other arena moved
+// brk since. The arena's index sits in the top bits of every header. A
+// thread frees a block of another arena by pushing it on that arena's
+// remote list with compare and swap, the arena's next malloc or free takes
+// the whole list. Freed slots of the thread's own arena stay in its
+// thread cache for the next malloc of their class, so the common
+// malloc/free pair takes no lock at all
+#define MAX_ARENAS 64 // threads beyond this share arenas
+#define CACHE_MAX 16  // slots a thread cache keeps per slab class
+
+// sizes and addresses of the blocks of a short free list, side by side so a
+// fit check looks at all of them at once
+typedef struct fit_vector
+{
+    uint32_t sizes[VECTOR_SLOTS]; // block sizes, 0 in unused slots so they never fit
+    char *blocks[VECTOR_SLOTS];   // blocks, in no particular order
+    uint32_t count;               // blocks in the list, the slots mirror it while they all fit
+    bool stale;                   // the list outgrew the slots since they were last filled
+} fit_vector;
+
+// an arena, i.e. a set of free lists with its own lock, kept in the heap
+typedef struct arena
+{
+    int lock;                              // spinlock, held while anything below changes
+    uint32_t index;                        // index in the arena table, kept in every header
+    uint32_t threads;                      // threads attached to the arena
+    uint8_t sl_bitmap[FL_INDEX_COUNT];     // bit s of entry f set if list (f, s) is non-empty
+    uint64_t fl_bitmap;                    // bit f set if any list of first level f is non-empty
+    char *remote_list;                     // blocks freed by other threads, linked through their first word
+    char *first_chunk;                     // chunks of the arena, linked through their first word
+    char *last_chunk;                      // chunk that extend_heap tries to grow in place
+    char *heap_end;                        // end of last_chunk
+    char *top;                             // free block at heap_end, kept out of the lists, or NULL
+    char *rover;                           // next fit: listed block the next search starts at, or NULL
+    char *large_root;                      // splay tree of the free blocks of LARGE_MIN bytes or more
+    uint64_t free_clock;                   // calls of free_block so far, the age of free blocks
+    fit_vector *vectors;                   // fit vectors of the first VECTOR_CLASS_COUNT classes, or NULL
+    uint64_t walked;                       // list nodes the searches looked at, for the driver
+    mm_fit_t fit_policy;                   // how find_free_list and insert_free treat the lists
+    uint64_t roots[CLASS_COUNT];           // free list matrix
+    uint64_t slab_roots[SLAB_CLASS_COUNT]; // run lists
+} arena;
+
+// table of all arenas, at the beginning of the heap
+typedef struct arena_table
+{
+    int lock;                     // spinlock, held while threads attach or detach
+    int brk_lock;                 // spinlock, held while brk moves, innermost of all locks
+    uint32_t arena_count;         // arenas created so far
+    uint32_t next_shared;         // round robin counter once every arena is taken
+    mm_fit_t fit_policy;          // fit policy new arenas start with
+    bool prefetch;                // list walks prefetch the next node
+    arena *arenas[MAX_ARENAS];    // arenas by index
+} arena_table;
+
+// per-thread cache of freed slots, kept in the heap
+typedef struct thread_cache
+{
+    arena *arena;                       // arena the thread is attached to
+    uint8_t counts[SLAB_CLASS_COUNT];   // slots in each bin
+    char *bins[SLAB_CLASS_COUNT];       // freed slots, linked through their first word
+} thread_cache;
+
+static char *heap_listp;                 // Pointer to beginning of heap, i.e. the arena table
+static char *page_map;                   // root node of the page map, NULL until the first run
+static uint32_t heap_epoch;              // bumped by mm_init, thread state of older heaps is stale
+static pthread_key_t cache_key;          // flushes a thread's cache when the thread exits
+static bool cache_key_made;              // cache_key is created once per process
+static size_t trim_threshold = TRIM_THRESHOLD; // free block size at the end of the heap that makes free trim
+static uint32_t growth_percent = GROWTH_PERCENT; // share of the heap size a miss grows the heap by
+static size_t growth_max = GROWTH_MAX;           // cap on a growth step
+static __thread thread_cache *local_cache; // cache of the calling thread
+static __thread uint32_t local_epoch;    // heap_epoch when local_cache was made
 
 // List of SMALL helper functions
-static size_t align(size_t x);                // rounds up to the nearest multiple of ALIGNMENT
-static void put(void *p, uint64_t val);       // write val to p
-static uint64_t pack(size_t size, int alloc); // pack size & alloc bit into a word
-static char *get_header(void *bp);            // given ptr of user space, get ptr of header
-static size_t get_size(void *bp);             // given ptr of header|footer, read the size of entire block
-static char *get_footer(void *bp);            // given ptr of user space, get ptr of footer
-static char *get_nextblk(void *bp);           // given ptr of user space, get ptr of next block's user space
-static char *get_prevblk(void *bp);           // given ptr of user space, get ptr of prev block's user space
-static bool get_alloc(void *ptr);             // given ptr of header or footer, get alloc bit
-static void set_ptr(void *p, char *val);      // given ptr of a word, set prev|next ptr
-static char *get_ptr(void *bp);               // given ptr of a word, read prev|next ptr
-static void set_prevalloc(void *p);           // given ptr of header or footer, set prev alloc bit
+static size_t align(size_t x);                         // rounds up to the nearest multiple of ALIGNMENT
+static void put(void *p, uint64_t val);                // write val to p
+static uint64_t pack(size_t size, int alloc);          // pack size and alloc bit into a word
+static char *get_header(void *bp);                     // given ptr of user space, get ptr of header
+static size_t get_size(void *bp);                      // given ptr of header|footer, read the size of entire block
+static char *get_footer(void *bp);                     // given ptr of user space, get ptr of footer
+static char *get_nextblk(void *bp);                    // given ptr of user space, get ptr of next block's user space
+static char *get_prevblk(void *bp);                    // given ptr of user space, get ptr of prev block's user space
+static bool get_alloc(void *ptr);                      // given ptr of header or footer, get alloc bit
+static void set_ptr(void *p, char *val);               // given ptr of a word, set prev|next ptr
+static char *get_ptr(void *bp);                        // given ptr of a word, read prev|next ptr
+static void set_prevalloc(void *p);                    // given ptr of header, set prev alloc bit
+static bool get_prevalloc(void *ptr);                  // given ptr of header, get prev alloc bit
+static bool get_decommitted(void *ptr);                // given ptr of header, check if the interior pages are decommitted
+static uint64_t get_prevbits(void *ptr);               // given ptr of header, get prev alloc bit
+static uint64_t follow_bits(bool alloc);               // prev bits of the block following an allocated or free block
+static uint64_t owner_bits(arena *a);                  // owner bits of the headers of an arena
+static arena *get_owner(void *ptr);                    // given ptr of header, get the arena owning the block
+static size_t adjust_size(size_t size);                // given payload size, get size of the allocated block
+static char *aligned_payload(char *bp, size_t alignment); // given a free block, get where an aligned payload in it starts
+static int find_last_set(size_t x);                    // index of the most significant set bit, x != 0
+static int find_first_set(uint64_t x);                 // index of the least significant set bit, x != 0
+static char *get_root(arena *a, int fl, int sl);       // given class index, get ptr of its list root
+static bool is_epilogue(char *bp);                     // given ptr of user space, check if it is the epilogue
+static void update_next(char *bp);                     // given ptr of user space, fix prev bits of next block
+static void set_free_block(arena *a, char *bp, size_t size, uint64_t prev_bits); // write a free block not in any list
+static int slab_class(size_t size);                    // given request size, get its slab class
+static size_t slab_slot_size(int cls);                 // given slab class, get its slot size
+static int slab_aligned_class(size_t size, size_t alignment); // smallest slab class with aligned slots that fit size, -1 if none
+static char *get_slab_root(arena *a, int cls);         // given slab class, get ptr of its run list root
+static char *get_slots(slab_run *run);                 // given run, get ptr of its first slot
+static size_t get_page_index(void *p, int level);      // given ptr, get its page map index at a level
+static void spin_lock(int *lock);                      // take a spinlock
+static void spin_unlock(int *lock);                    // release a spinlock
+static arena_table *get_table(void);                   // get the arena table at the beginning of the heap
+static bool is_mapped(const void *p);                  // given ptr of user space, check if it is in a mapping of its own
+static char *map_start(char *bp);                      // given ptr of a mapped block, get the start of its mapping
+static bool is_old(arena *a, char *bp);                // given ptr of a free block, check if it stayed free DECOMMIT_AGE frees
+static size_t grow_size(arena *a, size_t block_size);  // given a block size no free block fits, get bytes to extend heap by
 
 // List of BIG helper functions
-static void *coalesce(char *bp);                           // coalesce helper function
-static void *extend_heap(size_t words);                    // extend heap helper function
-static void *find_free_list(size_t require_size);          // find free block in free lists
-static void allocate(char *bp, size_t size);               // allocate helper function
-static void insert_free(char *new_bp, size_t insert_size); // insert free block into free list
-static void reset_free(char *bp);                          // reset free block in free list
-static int pick_root(size_t size);                         // pick root for insert_free
+static void *coalesce(arena *a, char *bp);                   // coalesce helper function
+static void *extend_heap(arena *a, size_t words);            // extend heap helper function
+static char *new_chunk(arena *a, char *p);                   // start a chunk at p, get ptr of its first block
+static void *find_free_list(arena *a, size_t require_size);  // find free block in free lists
+static void allocate(arena *a, char *bp, size_t size);       // allocate helper function
+static void insert_free(arena *a, char *new_bp, size_t insert_size); // insert free block into free list
+static void reset_free(arena *a, char *bp);                  // reset free block in free list
+static bool fit_class(arena *a, size_t size, int *fl, int *sl); // first non-empty class whose blocks all fit size
+static char *fit_first(arena *a, size_t size);               // head of the first class that surely fits
+static char *fit_best(arena *a, size_t size);                // smallest block that fits
+static char *fit_next(arena *a, size_t size);                // first fit from where the last search stopped
+static char *fit_good(arena *a, size_t size);                // smallest of the first FIT_CANDIDATES that fit
+static char *fit_address(arena *a, size_t size);             // lowest address that fits
+static void insert_lifo(arena *a, char *bp, char *root);     // push a free block on the front of its list
+static void insert_address(arena *a, char *bp, char *root);  // link a free block in address order
+static char *fit_find(arena *a, size_t size);                // a listed block of at least size bytes by the fit policy, or NULL
+static void fit_insert(arena *a, char *bp, char *root);      // link a free block into its list by the fit policy
+static bool fit_walks(mm_fit_t policy);                      // check if a fit policy walks lists and wants fit vectors
+static void set_vectors(arena *a);                           // give an arena fit vectors or drop them, as the fit policy wants
+static char *walk_step(arena *a, char *bp);                  // given a listed block, get its next and start loading that
+static fit_vector *get_vector(arena *a, int fl, int sl);     // fit vector mirroring a class, or NULL
+static void vector_insert(arena *a, int fl, int sl, char *bp, size_t size); // note a block listed in a class
+static void vector_remove(arena *a, int fl, int sl, char *bp); // note a block unlinked from a class
+static unsigned vector_match(fit_vector *v, size_t size);    // bit i set if slot i holds a block that fits size
+static char *vector_smallest(fit_vector *v, unsigned mask, size_t *size); // smallest block of the slots in mask
+static char *vector_lowest(fit_vector *v, unsigned mask);    // lowest address of the slots in mask
+static int tree_cmp(size_t size, char *addr, char *node);    // compare (size, addr) with the key of a tree node
+static char *tree_splay(char *t, size_t size, char *addr);   // splay the node nearest (size, addr) to the root
+static void tree_insert(arena *a, char *bp);                 // add a free block to the large tree
+static void tree_remove(arena *a, char *bp);                 // take a free block out of the large tree
+static char *tree_find(arena *a, size_t size, char *addr);   // smallest node not below (size, addr)
+static void shrink_block(arena *a, char *bp, size_t size);   // split the tail off an allocated block
+static bool grow_block(arena *a, char *bp, size_t size);     // grow an allocated block in place
+static void mapping_units(size_t units, int *fl, int *sl);   // class of a biased count of ALIGNMENT units
+static void mapping_insert(size_t size, int *fl, int *sl);   // class a free block of size belongs to
+static void mapping_search(size_t size, int *fl, int *sl);   // first class whose blocks all fit size
+static void *find_or_extend(arena *a, size_t block_size);    // find a free block that fits, grow the heap if none does
+static void *alloc_block(arena *a, size_t block_size);       // allocate a regular block
+static void *alloc_aligned(arena *a, size_t alignment, size_t block_size); // allocate a block with aligned payload
+static size_t alloc_batch(arena *a, size_t block_size, size_t n, void **out); // allocate n regular blocks
+static void free_block(arena *a, char *bp);                  // free a regular block
+static void free_span(arena *a, char *bp, size_t size, size_t count); // free count allocated blocks in a row
+static void sort_ptrs(void **ptrs, size_t n);                // sort ptrs by address
+static bool trim_arena(arena *a, size_t pad);                // give the free tail of an arena's chunk at brk back
+static void decommit_block(char *bp);                        // decommit the interior pages of a free block
+static bool release_sweep(arena *a, bool all);               // decommit the big free blocks that stayed free long, or all of them
+static void *map_alloc(size_t alignment, size_t size);       // allocate a block with aligned payload in a mapping of its own
+static void map_free(char *bp);                              // unmap a mapped block
+static void *map_realloc(char *bp, size_t size);             // resize a mapped block
+static slab_run *page_map_get(void *p);                      // given ptr, get the run owning its page
+static bool page_map_set(arena *a, void *p, slab_run *run);  // map the page of p to run
+static slab_run *new_run(arena *a, int cls);                 // carve a new run for a slab class
+static void link_run(slab_run *run, char *root);             // push run on its class list
+static void unlink_run(slab_run *run, char *root);           // take run off its class list
+static void *slab_alloc(arena *a, size_t size);              // allocate a slot
+static void slab_free(arena *a, slab_run *run, char *ptr);   // free a slot
+static void init_arena(arena *a, uint32_t index);            // set up an empty arena
+static thread_cache *get_cache(void);                        // get the calling thread's cache, attach the thread on first use
+static void flush_cache(void *cache);                        // give cached slots back and detach, runs at thread exit
+static void free_slot(slab_run *run, char *ptr);             // free a slot under the lock of its arena
+static void push_remote(arena *a, char *ptr);                // hand a block to its arena from another thread
+static void drain_remote(arena *a);                          // free the blocks other threads handed to a
+static void free_owned(thread_cache *cache, slab_run *run, char *ptr); // free a block (or slot of run) to its arena
+static bool check_arena(arena *a, int line_number);          // mm_checkheap for a single arena
+static bool check_tree(char *node, char **prev, size_t *count, int line_number); // mm_checkheap for a subtree of the large tree
+static bool check_size(void *ptr, size_t size, int line_number); // check the size given to a sized free fits the block
 
 // List of mm functions
 bool mm_init(void);
+bool mm_trim(size_t pad);
+void mm_set_trim_threshold(size_t threshold);
+void mm_set_heap_growth(unsigned percent, size_t max);
+void mm_set_fit_policy(mm_fit_t policy);
+bool mm_set_prefetch(bool on);
+size_t mm_list_nodes(void);
 void *malloc(size_t size);
 void free(void *ptr);
 void *realloc(void *oldptr, size_t size);
+size_t mm_malloc_batch(size_t size, size_t n, void **out);
+void mm_free_batch(void **ptrs, size_t n);
+void mm_free_sized(void *ptr, size_t size);
+void *mm_realloc_sized(void *ptr, size_t old_size, size_t new_size);
+void *memalign(size_t alignment, size_t size);
+void *aligned_alloc(size_t alignment, size_t size);
+int posix_memalign(void **memptr, size_t alignment, size_t size);
 
 static size_t align(size_t x)
 {
@@ -110,8 +410,8 @@ static char *get_header(void *bp)
 static size_t get_size(void *bp)
 {
     // Given ptr of header|footer, read the size of userspace, including header and footer
-    //&~0xf to get rid of last 4 bits
-    return (size_t)(*(uint64_t *)bp & ~0xf);
+    //&~0xf to get rid of last 4 bits, the owner bits go too
+    return (size_t)(*(uint64_t *)bp & SIZE_MASK);
 }
 
 static char *get_footer(void *bp)
@@ -130,13 +430,14 @@ static char *get_nextblk(void *bp)
 
 static char *get_prevblk(void *bp)
 {
+    // only valid if prev block is free, allocated blocks have no footer
     size_t prev_size = get_size((char *)bp - DSIZE); // go to prev footer and read size
     return (char *)bp - prev_size;
 }
 
 static bool get_alloc(void *ptr)
 {
-    return (bool)(*(unsigned int *)(ptr)&0x1);
+    return (bool)(*(uint64_t *)(ptr)&0x1);
 }
 
 static void set_ptr(void *p, char *val)
@@ -151,63 +452,251 @@ static char *get_ptr(void *bp)
 
 static void set_prevalloc(void *p)
 {
-    *(uint64_t *)p = *(uint64_t *)p | 2;
+    *(uint64_t *)p = *(uint64_t *)p | PREV_ALLOC;
 }
 
 static bool get_prevalloc(void *ptr)
 {
-    return (bool)(*(unsigned int *)(ptr)&0x2);
+    return (bool)(*(uint64_t *)(ptr)&PREV_ALLOC);
+}
+
+static bool get_decommitted(void *ptr)
+{
+    return (bool)(*(uint64_t *)(ptr)&DECOMMITTED);
+}
+
+static uint64_t get_prevbits(void *ptr)
+{
+    return *(uint64_t *)ptr & PREV_ALLOC;
+}
+
+static uint64_t follow_bits(bool alloc)
+{
+    return alloc ? PREV_ALLOC : 0;
+}
+
+static uint64_t owner_bits(arena *a)
+{
+    return (uint64_t)a->index << OWNER_SHIFT;
+}
+
+static arena *get_owner(void *ptr)
+{
+    // the header may be rewritten by the owner meanwhile, but not these bits
+    uint64_t header = __atomic_load_n((uint64_t *)ptr, __ATOMIC_RELAXED);
+    return get_table()->arenas[header >> OWNER_SHIFT];
+}
+
+static size_t adjust_size(size_t size)
+{
+    // allocated block only carries a header, but it gets at least
+    // MIN_BLOCK_SIZE, what it needs once it is free
+    size_t block_size = align(size + WSIZE);
+    return block_size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : block_size;
+}
+
+static char *aligned_payload(char *bp, size_t alignment)
+{
+    // the gap in front is empty or must hold a free block of its own
+    char *aligned_bp = (char *)(((uintptr_t)bp + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    if (aligned_bp != bp && aligned_bp - bp < MIN_BLOCK_SIZE)
+    {
+        aligned_bp += alignment;
+    }
+    return aligned_bp;
+}
+
+static void update_next(char *bp)
+{
+    // next block's prev bits describe bp, rewrite them after bp changed
+    char *next_header = get_header(get_nextblk(bp));
+    uint64_t bits = follow_bits(get_alloc(get_header(bp)));
+    put(next_header, (*(uint64_t *)next_header & ~(uint64_t)PREV_ALLOC) | bits);
 }
 
-static int pick_root(size_t size)
+static void set_free_block(arena *a, char *bp, size_t size, uint64_t prev_bits)
 {
-    // pick root based on size
-    int root_index = 8;
-    if (size <= 32)
+    put(get_header(bp), pack(size, prev_bits) | owner_bits(a));
+    set_ptr(bp, NULL);         // reset prev ptr
+    set_ptr(bp + WSIZE, NULL); // reset next ptr
+    put(get_footer(bp), pack(size, 0));
+    if (size >= DECOMMIT_MIN)
     {
-        root_index = 0;
+        put(bp + DSIZE, a->free_clock); // the block is new, its age starts now
     }
-    else if (size <= 64)
+}
+
+static int find_last_set(size_t x)
+{
+    return 63 - __builtin_clzll(x);
+}
+
+static int find_first_set(uint64_t x)
+{
+    return __builtin_ctzll(x);
+}
+
+static char *get_root(arena *a, int fl, int sl)
+{
+    // roots are laid out row by row in the arena
+    return (char *)&a->roots[fl * SL_INDEX_COUNT + sl];
+}
+
+static int slab_class(size_t size)
+{
+    // 16 byte steps up to 128, then 32 byte steps up to 256, then 64 byte steps
+    if (size <= 128)
     {
-        root_index = 1;
+        return (int)((size - 1) >> 4);
     }
-    else if (size <= 128)
+    if (size <= 256)
     {
-        root_index = 2;
+        return (int)((size - 129) >> 5) + 8;
     }
-    else if (size <= 256)
+    return (int)((size - 257) >> 6) + 12;
+}
+
+static size_t slab_slot_size(int cls)
+{
+    if (cls < 8)
     {
-        root_index = 3;
+        return (size_t)(cls + 1) << 4;
     }
-    else if (size <= 512)
+    if (cls < 12)
     {
-        root_index = 4;
+        return (size_t)(cls - 3) << 5; // 160 = 5 * 32
     }
-    else if (size <= 1024)
+    return (size_t)(cls - 7) << 6; // 320 = 5 * 64
+}
+
+static int slab_aligned_class(size_t size, size_t alignment)
+{
+    // slots start at the same offset in every run and step by the slot size
+    if ((align(sizeof(slab_run)) & (alignment - 1)) != 0)
     {
-        root_index = 5;
+        return -1;
     }
-    else if (size <= 8192)
+    for (int cls = slab_class(size); cls < SLAB_CLASS_COUNT; cls++)
     {
-        root_index = 6;
+        if ((slab_slot_size(cls) & (alignment - 1)) == 0)
+        {
+            return cls;
+        }
     }
-    else if (size <= 16384)
+    return -1;
+}
+
+static char *get_slab_root(arena *a, int cls)
+{
+    return (char *)&a->slab_roots[cls];
+}
+
+static char *get_slots(slab_run *run)
+{
+    return (char *)run + align(sizeof(slab_run));
+}
+
+static size_t get_page_index(void *p, int level)
+{
+    // page number relative to the start of the heap, PAGE_MAP_BITS per level
+    size_t page = (size_t)((char *)p - (char *)mm_heap_lo()) >> PAGE_SHIFT;
+    return (page >> (level * PAGE_MAP_BITS)) & (PAGE_MAP_FANOUT - 1);
+}
+
+static bool is_mapped(const void *p)
+{
+    // mappings lie above anything mm_sbrk can ever return
+    return (const char *)p > (const char *)mm_heap_hi();
+}
+
+static char *map_start(char *bp)
+{
+    // the payload sits MAP_OFFSET bytes up to a page into its mapping
+    return (char *)(((uintptr_t)bp - MAP_OFFSET) & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+static size_t grow_size(arena *a, size_t block_size)
+{
+    // a top at brk is grown in place, only the bytes it lacks are new
+    size_t need = block_size;
+    if (a->top != NULL && a->heap_end == (char *)mm_heap_hi() + 1)
     {
-        root_index = 7;
+        size_t top_size = get_size(get_header(a->top));
+        need = top_size < need ? need - top_size : 0;
     }
-    else if (size >= 16384)
+
+    // the step grows with the heap, so a ramp-up takes few calls of mm_sbrk
+    size_t step = mm_heapsize() / 100 * growth_percent;
+    step = step < growth_max ? step : growth_max;
+    return need > step ? need : step;
+}
+
+static bool is_old(arena *a, char *bp)
+{
+    // blocks below DECOMMIT_MIN have no room for their age and count as old
+    size_t size = get_size(get_header(bp));
+    return size < DECOMMIT_MIN || a->free_clock - *(uint64_t *)(bp + DSIZE) >= DECOMMIT_AGE;
+}
+
+static void spin_lock(int *lock)
+{
+    // spin on a plain load, only try to take the lock once it looks free.
+    // the holder may have been preempted, so give up the cpu now and then
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
     {
-        root_index = 8;
+        for (int spins = 1; __atomic_load_n(lock, __ATOMIC_RELAXED); spins++)
+        {
+            if (spins % 64 == 0)
+            {
+                sched_yield();
+            }
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
     }
-    // printf("pick root index: %d for size %zu\n", root_index, size);
-    return root_index;
-    // return 8;
 }
 
-static void *coalesce(char *bp)
+static void spin_unlock(int *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static arena_table *get_table(void)
+{
+    return (arena_table *)heap_listp;
+}
+
+// map a count of ALIGNMENT units, biased by SL_INDEX_COUNT, to its class
+// the most significant bit picks the first level, the SL_INDEX_BITS bits
+// below it pick the second level. The bias makes units 0..SL_INDEX_COUNT-1
+// land linearly in first level 0, so there is no special case for them
+static void mapping_units(size_t units, int *fl, int *sl)
+{
+    int first = find_last_set(units) - SL_INDEX_BITS;
+    *fl = first;
+    *sl = (int)(units >> first) ^ SL_INDEX_COUNT; // drop the leading one
+}
+
+// map a block size to its (first level, second level) class
+static void mapping_insert(size_t size, int *fl, int *sl)
+{
+    mapping_units((size >> ALIGN_SHIFT) + SL_INDEX_COUNT, fl, sl);
+}
+
+// like mapping_insert, but round size up to the next class boundary first,
+// so that every block of the returned class (or any class above) fits size
+static void mapping_search(size_t size, int *fl, int *sl)
+{
+    size_t units = ((size + ALIGNMENT - 1) >> ALIGN_SHIFT) + SL_INDEX_COUNT;
+    units += ((size_t)1 << (find_last_set(units) - SL_INDEX_BITS)) - 1;
+    mapping_units(units, fl, sl);
+}
+
+static void *coalesce(arena *a, char *bp)
 {
 
-    bool prev_alloc = get_alloc(bp - DSIZE);
+    bool prev_alloc = get_prevalloc(get_header(bp));
     bool next_alloc = get_alloc(get_header(get_nextblk(bp)));
 
     // printf("attempt to coalesce %p\n", bp);
@@ -220,13 +709,12 @@ static void *coalesce(char *bp)
         size_t prev_size = get_size(get_header(prev_blk));
         size_t coalesce_size = curr_size + prev_size;
 
-        // delete prev block from free list, before header & footer are updated
-        reset_free(prev_blk);
+        // delete prev block from free list, before header and footer are updated
+        reset_free(a, prev_blk);
 
-        // update prev header
-        put(get_header(prev_blk), pack(coalesce_size, 0));
-        // update curr footer
-        put(get_footer(bp), pack(coalesce_size, 0));
+        // update prev header and curr footer, then tell the next block
+        set_free_block(a, prev_blk, coalesce_size, get_prevbits(get_header(prev_blk)));
+        update_next(prev_blk);
 
         // printf("case 1: prev free, next allocated\n");
         // printf("curr_blk: %p, size: %zu\n", bp, curr_size);
@@ -241,13 +729,12 @@ static void *coalesce(char *bp)
         size_t next_size = get_size(get_header(next_blk));
         size_t coalesce_size = curr_size + next_size;
 
-        // delete next block from free list, before header & footer are updated
-        reset_free(next_blk);
+        // delete next block from free list, before header and footer are updated
+        reset_free(a, next_blk);
 
-        // update curr header
-        put(get_header(bp), pack(coalesce_size, 0));
-        // update next footer
-        put(get_footer(next_blk), pack(coalesce_size, 0));
+        // update curr header and next footer, then tell the next block
+        set_free_block(a, bp, coalesce_size, get_prevbits(get_header(bp)));
+        update_next(bp);
 
         // printf("case 2: prev allocated, next free\n");
         // printf("curr_blk: %p, size: %zu\n", bp, curr_size);
@@ -265,14 +752,13 @@ static void *coalesce(char *bp)
         size_t next_size = get_size(get_header(next_blk));
         size_t coalesce_size = curr_size + prev_size + next_size;
 
-        // reset free list ptr for prev & next block
-        reset_free(prev_blk);
-        reset_free(next_blk);
+        // reset free list ptr for prev and next block
+        reset_free(a, prev_blk);
+        reset_free(a, next_blk);
 
-        // update prev header
-        put(get_header(prev_blk), pack(coalesce_size, 0));
-        // update next footer
-        put(get_footer(next_blk), pack(coalesce_size, 0));
+        // update prev header and next footer, then tell the next block
+        set_free_block(a, prev_blk, coalesce_size, get_prevbits(get_header(prev_blk)));
+        update_next(prev_blk);
 
         // printf("case3 : prev free, next free\n");
         // printf("curr_blk: %p, size: %zu\n", bp, curr_size);
@@ -282,85 +768,86 @@ static void *coalesce(char *bp)
         return prev_blk;
     }
 
-    // printf("case 4: Both prev & next allocated\n");
+    // printf("case 4: Both prev and next allocated\n");
     return bp; // case 4: prev allocated, next allocated
 }
 
 // insert free block into free list
-static void insert_free(char *new_bp, size_t insert_size)
+static void insert_free(arena *a, char *new_bp, size_t insert_size)
 {
-    // choose root
-    int root_index = pick_root(insert_size);
-    char *insert_root = root_array[root_index];
-
-    // store ptr in the root
-    char *old_prev = get_ptr(insert_root);
-
-    // if root is empty, insert new block as first free block
-    if (old_prev == NULL)
+    // the block at the end of the last chunk becomes the top, the lists
+    // never hand it out, so small requests don't carve up what can grow
+    if (new_bp + insert_size == a->heap_end)
     {
-        set_ptr(insert_root, new_bp);
-        set_ptr(new_bp, insert_root);
-        set_ptr(new_bp + WSIZE, NULL);
+        a->top = new_bp;
         return;
-
-        // printf("insert free block %p success\n", new_bp);
-        // printf("insert in Root: %d\n", root_index);
     }
-    else
+
+    // big blocks are kept sorted by size in the large tree
+    if (insert_size >= LARGE_MIN)
     {
-        size_t new_size = get_size(get_header(new_bp));
-        size_t old_size = get_size(get_header(old_prev));
+        tree_insert(a, new_bp);
+        return;
+    }
 
-        // sort free block by size each insertion
-        // if new block is smaller than old block, insert before old block
-        if (new_size <= old_size)
-        {
-            set_ptr(insert_root, new_bp);      // set root points to new_bp
-            set_ptr(new_bp, insert_root);      // set new_bp prev points to root
-            set_ptr(new_bp + WSIZE, old_prev); // set new_bp next points to old_prev
-            set_ptr(old_prev, new_bp);         // set old_prev points to new_bp
-        }
-        // if new block is bigger than old block, insert after old block
-        else if (new_size > old_size)
-        {
-            char *old_next = old_prev + WSIZE;
-            char *old_nextblk = get_ptr(old_next);
+    // choose root, the fit policy decides where in the list the block goes
+    int fl, sl;
+    mapping_insert(insert_size, &fl, &sl);
+    fit_insert(a, new_bp, get_root(a, fl, sl));
+    vector_insert(a, fl, sl, new_bp, insert_size);
 
-            set_ptr(old_next, new_bp); // set old_next prev points to new_bp
-            set_ptr(new_bp, old_prev); // set new_bp prev points to old_next
-            set_ptr(new_bp + WSIZE, NULL);
+    // mark list as non-empty
+    a->fl_bitmap |= (uint64_t)1 << fl;
+    a->sl_bitmap[fl] |= 1 << sl;
 
-            if (old_nextblk != NULL)
-            {
-                set_ptr(new_bp + WSIZE, old_nextblk); // set new_bp next points to old_next
-                set_ptr(old_nextblk, new_bp);         // set old_next points to new_bp
-            }
-        }
-        // printf("insert free block %p success\n", new_bp);
-    }
+    // printf("insert free block %p success\n", new_bp);
 }
 
-static void reset_free(char *bp)
+static void reset_free(arena *a, char *bp)
 {
+    if (bp == a->top)
+    {
+        a->top = NULL;
+        return;
+    }
+    if (get_size(get_header(bp)) >= LARGE_MIN)
+    {
+        tree_remove(a, bp);
+        return;
+    }
+    if (bp == a->rover)
+    {
+        a->rover = get_ptr(bp + WSIZE); // next fit goes on after the block
+    }
+
     char *prev = get_ptr(bp);
     char *next = get_ptr(bp + WSIZE);
 
-    // identify root
-    int root_index = pick_root(get_size(get_header(bp)));
-    char *root = root_array[root_index];
-
     if (prev == 0 && next == 0)
     {
         return;
     }
 
+    // identify root
+    int fl, sl;
+    mapping_insert(get_size(get_header(bp)), &fl, &sl);
+    char *root = get_root(a, fl, sl);
+    vector_remove(a, fl, sl, bp);
+
     if (prev == root) // if node is first in list
     {
         if (next) // if node has next
         {
             set_ptr(next, root); // set prevptr of next blocl points to root
         }
+        else // list becomes empty, clear its bits
+        {
+            a->sl_bitmap[fl] &= ~(1 << sl);
+            if (a->sl_bitmap[fl] == 0)
+            {
+                a->fl_bitmap &= ~((uint64_t)1 << fl);
+            }
+        }
         set_ptr(root, next); // set root points to next block
     }
 
@@ -375,7 +862,9 @@ static void reset_free(char *bp)
 }
 
 // extend heap helper function
-static void *extend_heap(size_t words)
+// grows the arena's last chunk in place if brk is still at its end,
+// otherwise the new space becomes a chunk of its own
+static void *extend_heap(arena *a, size_t words)
 {
     char *bp;
     size_t size = align(words); // align size
@@ -385,238 +874,2119 @@ static void *extend_heap(size_t words)
         size = WSIZE * 4;
     }
 
-    if ((bp = mm_sbrk(size)) == (void *)-1)
+    // a new chunk needs room for its prologue and epilogue, brk can't move
+    // between the check and mm_sbrk under the brk lock
+    arena_table *t = get_table();
+    spin_lock(&t->brk_lock);
+    bool in_place = a->heap_end == (char *)mm_heap_hi() + 1;
+    size_t sbrk_size = in_place ? size : size + 4 * WSIZE;
+    if ((bp = mm_sbrk(sbrk_size)) == (void *)-1)
     {
+        spin_unlock(&t->brk_lock);
         return NULL;
     }
+    spin_unlock(&t->brk_lock);
+    if (!in_place)
+    {
+        bp = new_chunk(a, bp);
+        sbrk_size -= 4 * WSIZE;
+    }
+    a->heap_end = bp + sbrk_size;
 
-    /* Initialize free block header/footer & update the epilogue header */
-    put(get_header(bp), pack(size, 0)); /* Free block header */
-    set_ptr(bp, NULL);                  /* Free block prev ptr */
-    set_ptr(bp + WSIZE, NULL);          /* Free block next ptr */
+    // the old top can't grow any more, it goes to the lists
+    if (!in_place && a->top != NULL)
+    {
+        char *old_top = a->top;
+        a->top = NULL;
+        insert_free(a, old_top, get_size(get_header(old_top)));
+    }
 
-    put(get_footer(bp), pack(size, 0)); /* Free block footer */
+    /* Initialize free block header/footer and update the epilogue header */
+    uint64_t prev_bits = get_prevbits(get_header(bp));     /* Taken over from old epilogue */
+    put(get_header(bp + sbrk_size), pack(0, ALLOC));        /* New epilogue header */
+    set_free_block(a, bp, sbrk_size, prev_bits);           /* Free block header, footer and ptrs */
+    update_next(bp);
 
-    put(get_header(get_nextblk(bp)), pack(0, 3)); /* New epilogue header */
+    // merge with a free block at the end of the old heap, the result is
+    // handed to the caller and is not in any free list
+    bp = coalesce(a, bp);
 
     // printf("extend heap by %zu success\n", words);
 
-    mm_checkheap(__LINE__);
+    // no mm_checkheap here, bp is free but in no list until the caller takes it
     return bp;
 }
 
-static void *find_free_list(size_t require_size)
+// helper function
+// given an arena and fresh space from mm_sbrk, write the fences of a new chunk
+// there and append it to the arena's chunks
+static char *new_chunk(arena *a, char *p)
 {
-
-    // pick root based on size
-    int root_index = pick_root(require_size);
-    char *root;
-    char *iter;
-    // iterate from root_index to 8
-    // printf("attempt to find freeblk for size %zu from root %d\n", require_size, root_index);
-    for (int i = root_index; i < 9; i++)
+    put(p, 0); // link to the next chunk of the arena
+    if (a->last_chunk != NULL)
     {
-        root = root_array[i];
-        iter = get_ptr(root);
-        // iterating from root
-        while (iter != NULL)
-        {
-            if (get_size(get_header(iter)) >= require_size)
-            {
-                return iter;
-            }
-            iter = get_ptr(iter + WSIZE);
-        }
+        set_ptr(a->last_chunk, p);
+    }
+    else
+    {
+        a->first_chunk = p;
     }
+    a->last_chunk = p;
 
-    // printf("no free list found\n");
-    return NULL; // No fit
+    put(p + 1 * WSIZE, pack(DSIZE, ALLOC));          // Prologue header
+    put(p + 2 * WSIZE, pack(DSIZE, ALLOC));          // Prologue footer
+    put(p + 3 * WSIZE, pack(0, PREV_ALLOC | ALLOC)); // Epilogue header
+    return p + 4 * WSIZE;
 }
 
-// helper function
-// given ptr of free block & required size
-// if free block has at least 4*WSIZE extra space after allocated, split
-// if not, allocate the whole block
-static void allocate(char *bp, size_t requested_size)
+static void *find_free_list(arena *a, size_t require_size)
 {
-    // get total size of free block
-    size_t total_size = get_size(get_header(bp));
-    size_t remain_size = total_size - requested_size - DSIZE;
-    size_t allocate_size = requested_size + DSIZE;
-
-    // if free block is big enough, split
-    if (remain_size >= WSIZE * 4)
+    // the fit policy searches the lists, then the best fit among the big blocks
+    char *bp = fit_find(a, require_size);
+    if (bp != NULL)
     {
-        reset_free(bp); // reset prev&next ptr in the block
-        // update size & alloc bit of header & footer in allocated block
-        put(get_header(bp), pack(allocate_size, 1));
-        put(bp + allocate_size - DSIZE, pack(allocate_size, 1));
-
-        char *remainblk = bp + allocate_size;
-
-        // update size & alloc bit of header & footer in remaining block
-        put(get_header(remainblk), pack(remain_size, 0));
-        put(get_footer(remainblk), pack(remain_size, 0));
-        set_ptr(remainblk, NULL); // reset prev&next ptr in the block
-        set_ptr(remainblk + WSIZE, NULL);
-
-        // printf("split %p success! \ntotal_size: %zu\nallocate_size: %zu\nremain_size: %zu \nnew free blk: %p\n", (void *)bp, total_size, allocate_size, remain_size, remainblk);
-
-        // coalesce & insert remain free block into free list
-        char *coalece_block = coalesce(remainblk);
-        insert_free(coalece_block, get_size(get_header(coalece_block)));
+        return bp;
     }
-    else
+    bp = tree_find(a, require_size, NULL);
+    if (bp != NULL)
     {
-        reset_free(bp); // reset prev&next ptr in the block
-        // if not, allocate the whole block
-        put(get_header(bp), pack(total_size, 1));
-        put(get_footer(bp), pack(total_size, 1));
+        return bp;
     }
-}
 
-/*
- * mm_init: returns false on error, true on success.
- */
+    // the top is the last resort before growing the heap
+    if (a->top != NULL && get_size(get_header(a->top)) >= require_size)
+    {
+        return a->top;
+    }
 
-bool mm_init(void)
+    // printf("no free list found\n");
+    return NULL; // No fit
+}
+
+// helper function
+// given a size, find the first non-empty class whose blocks all fit it.
+// returns false if there is none
+static bool fit_class(arena *a, size_t size, int *fl, int *sl)
 {
-    // Create an empty heap
-    if ((heap_listp = mm_sbrk(12 * WSIZE)) == (void *)-1)
+    mapping_search(size, fl, sl);
+    if (*fl >= FL_INDEX_COUNT)
     {
         return false;
     }
-    // initialize free list root array
-    for (int i = 0; i < 9; i++)
+    // non-empty lists of the same first level, at or above sl
+    unsigned int sl_map = a->sl_bitmap[*fl] & (~0U << *sl);
+    if (sl_map == 0)
     {
-        root_array[i] = heap_listp + i * WSIZE;
-        put(root_array[i], 0);
+        // non-empty first levels above fl
+        uint64_t fl_map = a->fl_bitmap & (~(uint64_t)0 << (*fl + 1));
+        if (fl_map == 0)
+        {
+            return false;
+        }
+        *fl = find_first_set(fl_map);
+        sl_map = a->sl_bitmap[*fl];
     }
+    *sl = find_first_set(sl_map);
+    return true;
+}
 
-    // Initialize heap space
-    put(heap_listp + 9 * WSIZE, 0);               // Alignment block
-    put(heap_listp + 10 * WSIZE, pack(DSIZE, 1)); // Prologue header
-    put(heap_listp + 11 * WSIZE, pack(DSIZE, 1)); // Prologue footer
-    put(heap_listp + 12 * WSIZE, pack(0, 3));     // Epilogue header
-
-    // Extend the empty heap by 512 bytes
-    char *bp = extend_heap(512);
-    if (bp == NULL)
+// fit policy
+// the head of the first class that surely fits, else the head of the
+// request's own class if it happens to be big enough
+static char *fit_first(arena *a, size_t size)
+{
+    int fl, sl;
+    if (fit_class(a, size, &fl, &sl))
     {
-        return false;
+        return get_ptr(get_root(a, fl, sl));
     }
 
-    // choose root & insert free block into free list
-    insert_free(bp, 512);
-    // printf("############################### initialize success ##################################### \n");
-    return true;
+    // no class is guaranteed to fit, but the head of the request's own
+    // class may still be big enough, try it before growing the heap
+    mapping_insert(size, &fl, &sl);
+    char *head = get_ptr(get_root(a, fl, sl));
+    if (head != NULL && get_size(get_header(head)) >= size)
+    {
+        return head;
+    }
+    return NULL;
 }
 
-/*
- * malloc
- */
-
-void *malloc(size_t size)
+// fit policy
+// the smallest block that fits from the request's own class, else the
+// smallest block of the first class that surely fits
+static char *fit_best(arena *a, size_t size)
 {
-    // invalid request
-    if (size <= 0)
+    int fl, sl;
+    char *best = NULL;
+    size_t best_size = SIZE_MAX;
+    mapping_insert(size, &fl, &sl);
+    for (int pass = 0; pass < 2 && best == NULL; pass++)
     {
-        return NULL;
+        if (pass == 1 && !fit_class(a, size, &fl, &sl))
+        {
+            break;
+        }
+        fit_vector *v = get_vector(a, fl, sl);
+        if (v != NULL)
+        {
+            best = vector_smallest(v, vector_match(v, size), &best_size);
+            continue;
+        }
+        char *next;
+        for (char *bp = get_ptr(get_root(a, fl, sl)); bp != NULL; bp = next)
+        {
+            next = walk_step(a, bp);
+            size_t bp_size = get_size(get_header(bp));
+            if (bp_size >= size && bp_size < best_size)
+            {
+                best = bp;
+                best_size = bp_size;
+                if (bp_size == size) // can't do better
+                {
+                    break;
+                }
+            }
+        }
     }
+    return best;
+}
 
-    char *bp;
-    size_t align_side = align(size); // align size
-
-    // search free list for a fit
-    bp = find_free_list(align_side + DSIZE);
-    if (bp != NULL)
+// fit policy
+// the first block that fits, walking on from the block after the last one
+// handed out in its list, else like fit_first. The search starts there
+// next time
+static char *fit_next(arena *a, size_t size)
+{
+    char *bp = a->rover;
+    while (bp != NULL)
     {
-        allocate(bp, align_side);
-        // printf("malloc success! addr: %p, size: %zu\n\n", (void *)bp, size);
-        mm_checkheap(__LINE__);
-        return bp;
+        char *next = walk_step(a, bp);
+        if (get_size(get_header(bp)) >= size)
+        {
+            break;
+        }
+        bp = next;
     }
-
-    // no fit found, extend heap
-    size_t total_size = align_side + DSIZE;
-    bp = extend_heap(total_size); // add DSIZE for header & footer
     if (bp == NULL)
     {
-        return NULL;
+        bp = fit_first(a, size);
     }
-    // allocate(bp, align_side);
-    put(get_header(bp), pack(total_size, 1));
-    put(get_footer(bp), pack(total_size, 1));
-
-    // printf("malloc success! addr: %p, size: %zu\n\n", (void *)bp, size);
-
-    mm_checkheap(__LINE__);
+    a->rover = bp;
     return bp;
 }
 
-/*
- * free
- */
-void free(void *ptr)
+// fit policy
+// the smallest of the first FIT_CANDIDATES blocks that fit, from the
+// request's own class and then the first class that surely fits
+static char *fit_good(arena *a, size_t size)
 {
-    // invalid request
-    if (ptr == NULL)
-    {
-        return;
-    }
-
-    char *curr_header = get_header(ptr);
-    char *next_blk = get_nextblk(ptr);
-
-    // check if ptr is allocated
-    if (!get_alloc(curr_header))
+    int fl, sl;
+    char *best = NULL;
+    size_t best_size = SIZE_MAX;
+    int seen = 0;
+    mapping_insert(size, &fl, &sl);
+    for (int pass = 0; pass < 2 && seen < FIT_CANDIDATES; pass++)
     {
-        return;
+        if (pass == 1 && !fit_class(a, size, &fl, &sl))
+        {
+            break;
+        }
+        // a mirrored class holds no more than FIT_CANDIDATES blocks, all
+        // of those that fit are looked at in one go
+        fit_vector *v = get_vector(a, fl, sl);
+        if (v != NULL)
+        {
+            size_t v_size;
+            unsigned mask = vector_match(v, size);
+            char *bp = vector_smallest(v, mask, &v_size);
+            if (bp != NULL && v_size < best_size)
+            {
+                best = bp;
+                best_size = v_size;
+            }
+            seen += __builtin_popcount(mask);
+            continue;
+        }
+        char *next;
+        for (char *bp = get_ptr(get_root(a, fl, sl)); bp != NULL && seen < FIT_CANDIDATES; bp = next)
+        {
+            next = walk_step(a, bp);
+            size_t bp_size = get_size(get_header(bp));
+            if (bp_size >= size)
+            {
+                seen++;
+                if (bp_size < best_size)
+                {
+                    best = bp;
+                    best_size = bp_size;
+                }
+            }
+        }
     }
-
-    size_t block_size = get_size(curr_header);
-
-    // printf("attempt to free %p, size: %zu\n", ptr, block_size);
-
-    // update size & alloc bit of header & footer
-    put(curr_header, pack(block_size, 0));
-    put(get_footer(ptr), pack(block_size, 0));
-
-    // each time free, set next blk's prevalloc bit to 1
-    set_prevalloc(next_blk - 8);
-
-    // clear out prev & next block
-    set_ptr(ptr, NULL);
-    set_ptr(ptr + WSIZE, NULL);
-
-    // coalesce & insert free block into free list
-    char *coalece_block = coalesce(ptr);
-    insert_free(coalece_block, get_size(get_header(coalece_block)));
+    return best;
 }
 
-/*
- * realloc
- */
-void *realloc(void *oldptr, size_t size)
+// fit policy
+// lists are kept in address order, so the first block that fits in the
+// request's own class has the lowest address, else the head of the first
+// class that surely fits does
+static char *fit_address(arena *a, size_t size)
 {
-    if (size == 0)
+    int fl, sl;
+    mapping_insert(size, &fl, &sl);
+    fit_vector *v = get_vector(a, fl, sl);
+    if (v != NULL)
     {
-        free(oldptr);
-        return NULL;
+        char *bp = vector_lowest(v, vector_match(v, size));
+        if (bp != NULL)
+        {
+            return bp;
+        }
     }
-
-    if (oldptr == NULL)
+    else
+    {
+        char *next;
+        for (char *bp = get_ptr(get_root(a, fl, sl)); bp != NULL; bp = next)
+        {
+            next = walk_step(a, bp);
+            if (get_size(get_header(bp)) >= size)
+            {
+                return bp;
+            }
+        }
+    }
+    if (fit_class(a, size, &fl, &sl))
+    {
+        return get_ptr(get_root(a, fl, sl));
+    }
+    return NULL;
+}
+
+// helper function
+// given a free block and the root of its list, make it the first block
+static void insert_lifo(arena *a, char *bp, char *root)
+{
+    char *old_first = get_ptr(root);
+    set_ptr(root, bp);              // set root points to bp
+    set_ptr(bp, root);              // set bp prev points to root
+    set_ptr(bp + WSIZE, old_first); // set bp next points to old first block
+    if (old_first != NULL)
+    {
+        set_ptr(old_first, bp); // set old first block prev points to bp
+    }
+}
+
+// helper function
+// given a free block and the root of its list, link it in before the first
+// block at a higher address. Blocks listed before the policy was picked may
+// be out of order, which only costs fit quality
+static void insert_address(arena *a, char *bp, char *root)
+{
+    char *prev = root;
+    char *next = get_ptr(root);
+    while (next != NULL && next < bp)
+    {
+        prev = next;
+        next = walk_step(a, next);
+    }
+    set_ptr(bp, prev);
+    set_ptr(bp + WSIZE, next);
+    if (next != NULL)
+    {
+        set_ptr(next, bp);
+    }
+    set_ptr(prev == root ? root : prev + WSIZE, bp);
+}
+
+// helper function
+// given a size, search the lists with the fit policy of the arena
+static char *fit_find(arena *a, size_t size)
+{
+    switch (a->fit_policy)
+    {
+    case MM_FIT_BEST:
+        return fit_best(a, size);
+    case MM_FIT_NEXT:
+        return fit_next(a, size);
+    case MM_FIT_GOOD:
+        return fit_good(a, size);
+    case MM_FIT_ADDRESS:
+        return fit_address(a, size);
+    default:
+        return fit_first(a, size);
+    }
+}
+
+// helper function
+// given a free block and the root of its list, link it where the fit policy
+// in use wants it, in address order or on the front
+static void fit_insert(arena *a, char *bp, char *root)
+{
+    if (a->fit_policy == MM_FIT_ADDRESS)
+    {
+        insert_address(a, bp, root);
+    }
+    else
+    {
+        insert_lifo(a, bp, root);
+    }
+}
+
+// helper function
+// given a fit policy, check if it walks lists, those keep fit vectors
+static bool fit_walks(mm_fit_t policy)
+{
+    return policy == MM_FIT_BEST || policy == MM_FIT_GOOD || policy == MM_FIT_ADDRESS;
+}
+
+// helper function
+// given an arena whose lock is held, give it fit vectors if the fit policy
+// in use walks lists, drop them if not. The vectors are a regular block of
+// the arena. New ones only count the blocks of their lists, the first
+// search of a class fills its vector from the list
+static void set_vectors(arena *a)
+{
+    bool walks = fit_walks(a->fit_policy);
+    if (walks == (a->vectors != NULL))
+    {
+        return;
+    }
+    if (!walks)
+    {
+        char *bp = (char *)a->vectors;
+        a->vectors = NULL;
+        free_block(a, bp);
+        return;
+    }
+
+    // without vectors the lists are walked, so running out of memory is fine
+    fit_vector *vectors = alloc_block(a, adjust_size(VECTOR_CLASS_COUNT * sizeof(fit_vector)));
+    if (vectors == NULL)
+    {
+        return;
+    }
+    memset(vectors, 0, VECTOR_CLASS_COUNT * sizeof(fit_vector));
+    for (int cls = 0; cls < VECTOR_CLASS_COUNT; cls++)
+    {
+        for (char *bp = get_ptr(get_root(a, cls / SL_INDEX_COUNT, cls % SL_INDEX_COUNT)); bp != NULL; bp = get_ptr(bp + WSIZE))
+        {
+            vectors[cls].count++;
+        }
+        vectors[cls].stale = true;
+    }
+    a->vectors = vectors;
+}
+
+// helper function
+// given a block in a list, get the next block. While the caller tests the
+// given block, the next one's link words and header are on their way in,
+// they share a cache line unless the block starts one
+static char *walk_step(arena *a, char *bp)
+{
+    char *next = get_ptr(bp + WSIZE);
+#if PREFETCH
+    if (get_table()->prefetch && next != NULL)
+    {
+        __builtin_prefetch(next);
+        __builtin_prefetch(get_header(next));
+    }
+#endif
+    a->walked++;
+    return next;
+}
+
+// helper function
+// given a class, get its fit vector if the arena keeps one and the class
+// list is short enough to be mirrored, else NULL. Slots left stale by a
+// list that grew too long are refilled from the list here
+static fit_vector *get_vector(arena *a, int fl, int sl)
+{
+    int cls = fl * SL_INDEX_COUNT + sl;
+    if (a->vectors == NULL || cls >= VECTOR_CLASS_COUNT || a->vectors[cls].count > VECTOR_SLOTS)
+    {
+        return NULL;
+    }
+    fit_vector *v = &a->vectors[cls];
+    if (v->stale)
+    {
+        int i = 0;
+        for (char *bp = get_ptr(get_root(a, fl, sl)); bp != NULL; bp = get_ptr(bp + WSIZE), i++)
+        {
+            v->sizes[i] = (uint32_t)get_size(get_header(bp));
+            v->blocks[i] = bp;
+        }
+        for (; i < VECTOR_SLOTS; i++)
+        {
+            v->sizes[i] = 0;
+            v->blocks[i] = NULL;
+        }
+        v->stale = false;
+    }
+    return v;
+}
+
+// helper function
+// given a block just linked into class (fl, sl), add it to the class's fit
+// vector, or mark the vector stale if the list no longer fits in it
+static void vector_insert(arena *a, int fl, int sl, char *bp, size_t size)
+{
+    int cls = fl * SL_INDEX_COUNT + sl;
+    if (a->vectors == NULL || cls >= VECTOR_CLASS_COUNT)
+    {
+        return;
+    }
+    fit_vector *v = &a->vectors[cls];
+    if (++v->count > VECTOR_SLOTS)
+    {
+        v->stale = true;
+    }
+    else if (!v->stale)
+    {
+        v->sizes[v->count - 1] = (uint32_t)size;
+        v->blocks[v->count - 1] = bp;
+    }
+}
+
+// helper function
+// given a block about to be unlinked from class (fl, sl), drop it from the
+// class's fit vector, the last used slot moves into its place
+static void vector_remove(arena *a, int fl, int sl, char *bp)
+{
+    int cls = fl * SL_INDEX_COUNT + sl;
+    if (a->vectors == NULL || cls >= VECTOR_CLASS_COUNT)
+    {
+        return;
+    }
+    fit_vector *v = &a->vectors[cls];
+    v->count--;
+    if (v->stale)
+    {
+        return;
+    }
+    uint32_t last = v->count;
+    for (uint32_t i = 0; i < last; i++)
+    {
+        if (v->blocks[i] == bp)
+        {
+            v->sizes[i] = v->sizes[last];
+            v->blocks[i] = v->blocks[last];
+            break;
+        }
+    }
+    v->sizes[last] = 0;
+    v->blocks[last] = NULL;
+}
+
+// helper function
+// given a fit vector and a size, get a mask of the slots whose block fits it.
+// unused slots hold size 0 and never fit. Sizes of listed blocks stay below
+// LARGE_MIN, so the signed 32 bit compare is safe
+static unsigned vector_match(fit_vector *v, size_t size)
+{
+#ifdef __AVX2__
+    __m256i sizes = _mm256_loadu_si256((const __m256i *)v->sizes);
+    __m256i need = _mm256_set1_epi32((int)(size - 1));
+    return (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(sizes, need)));
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < VECTOR_SLOTS; i++)
+    {
+        mask |= (unsigned)(v->sizes[i] >= size) << i;
+    }
+    return mask;
+#endif
+}
+
+// helper function
+// given a fit vector and a mask of its slots, get the smallest block among
+// them and its size, or NULL if the mask is empty
+static char *vector_smallest(fit_vector *v, unsigned mask, size_t *size)
+{
+    char *best = NULL;
+    uint32_t best_size = UINT32_MAX;
+    for (; mask != 0; mask &= mask - 1)
+    {
+        int i = find_first_set(mask);
+        if (v->sizes[i] < best_size)
+        {
+            best = v->blocks[i];
+            best_size = v->sizes[i];
+        }
+    }
+    *size = best_size;
+    return best;
+}
+
+// helper function
+// given a fit vector and a mask of its slots, get the block at the lowest
+// address among them, or NULL if the mask is empty
+static char *vector_lowest(fit_vector *v, unsigned mask)
+{
+    char *lowest = NULL;
+    for (; mask != 0; mask &= mask - 1)
+    {
+        int i = find_first_set(mask);
+        if (lowest == NULL || v->blocks[i] < lowest)
+        {
+            lowest = v->blocks[i];
+        }
+    }
+    return lowest;
+}
+
+// helper function
+// given a key (size, addr) and a node of the large tree, tell if the key is
+// below, equal to or above the node's key. Blocks are ordered by size, then
+// by address, so every key is unique
+static int tree_cmp(size_t size, char *addr, char *node)
+{
+    size_t node_size = get_size(get_header(node));
+    if (size != node_size)
+    {
+        return size < node_size ? -1 : 1;
+    }
+    return addr < node ? -1 : (addr > node ? 1 : 0);
+}
+
+// helper function
+// given the root of a subtree and a key, splay top down until the node with
+// that key, or the last node on its search path, is the new root and return it.
+// A node keeps its left child in its first word and its right child in the second
+static char *tree_splay(char *t, size_t size, char *addr)
+{
+    if (t == NULL)
+    {
+        return NULL;
+    }
+    uint64_t side[2] = {0, 0}; // collects the right tree in side[0] and the left tree in side[1]
+    char *l = (char *)side;    // largest node of the left tree, links on through its right child
+    char *r = (char *)side;    // smallest node of the right tree, links on through its left child
+    for (;;)
+    {
+        int c = tree_cmp(size, addr, t);
+        if (c < 0)
+        {
+            char *child = get_ptr(t);
+            if (child == NULL)
+            {
+                break;
+            }
+            if (tree_cmp(size, addr, child) < 0) // zig-zig, rotate right
+            {
+                set_ptr(t, get_ptr(child + WSIZE));
+                set_ptr(child + WSIZE, t);
+                t = child;
+                if (get_ptr(t) == NULL)
+                {
+                    break;
+                }
+            }
+            set_ptr(r, t); // t and its right subtree join the right tree
+            r = t;
+            t = get_ptr(t);
+        }
+        else if (c > 0)
+        {
+            char *child = get_ptr(t + WSIZE);
+            if (child == NULL)
+            {
+                break;
+            }
+            if (tree_cmp(size, addr, child) > 0) // zig-zig, rotate left
+            {
+                set_ptr(t + WSIZE, get_ptr(child));
+                set_ptr(child, t);
+                t = child;
+                if (get_ptr(t + WSIZE) == NULL)
+                {
+                    break;
+                }
+            }
+            set_ptr(l + WSIZE, t); // t and its left subtree join the left tree
+            l = t;
+            t = get_ptr(t + WSIZE);
+        }
+        else
+        {
+            break;
+        }
+    }
+    // put the left and right trees under the new root
+    set_ptr(l + WSIZE, get_ptr(t));
+    set_ptr(r, get_ptr(t + WSIZE));
+    set_ptr(t, get_ptr((char *)side + WSIZE));
+    set_ptr(t + WSIZE, get_ptr((char *)side));
+    return t;
+}
+
+// helper function
+// given a free block of LARGE_MIN bytes or more, make it the root of the
+// large tree
+static void tree_insert(arena *a, char *bp)
+{
+    size_t size = get_size(get_header(bp));
+    char *root = tree_splay(a->large_root, size, bp);
+    if (root == NULL)
+    {
+        set_ptr(bp, NULL);
+        set_ptr(bp + WSIZE, NULL);
+    }
+    else if (tree_cmp(size, bp, root) < 0)
+    {
+        set_ptr(bp, get_ptr(root)); // root and what is above it go right of bp
+        set_ptr(bp + WSIZE, root);
+        set_ptr(root, NULL);
+    }
+    else
+    {
+        set_ptr(bp + WSIZE, get_ptr(root + WSIZE)); // root and what is below it go left of bp
+        set_ptr(bp, root);
+        set_ptr(root + WSIZE, NULL);
+    }
+    a->large_root = bp;
+}
+
+// helper function
+// given a free block of LARGE_MIN bytes or more, take it out of the large
+// tree if it is in there
+static void tree_remove(arena *a, char *bp)
+{
+    size_t size = get_size(get_header(bp));
+    char *root = tree_splay(a->large_root, size, bp);
+    if (root != bp) // not in the tree
+    {
+        a->large_root = root;
+        return;
+    }
+    if (get_ptr(bp) == NULL)
+    {
+        a->large_root = get_ptr(bp + WSIZE);
+        return;
+    }
+    // the largest node left of bp comes up with no right child, bp's right
+    // subtree goes there
+    root = tree_splay(get_ptr(bp), size, bp);
+    set_ptr(root + WSIZE, get_ptr(bp + WSIZE));
+    a->large_root = root;
+}
+
+// helper function
+// given a key (size, addr), find the free block in the large tree with the
+// smallest key that is not below it, i.e. the best fit for size. returns NULL
+// if every block is smaller
+static char *tree_find(arena *a, size_t size, char *addr)
+{
+    char *root = tree_splay(a->large_root, size, addr);
+    a->large_root = root;
+    if (root == NULL || tree_cmp(size, addr, root) <= 0)
+    {
+        return root;
+    }
+    // root is the last node below the key, its successor is the answer
+    char *bp = get_ptr(root + WSIZE);
+    while (bp != NULL && get_ptr(bp) != NULL)
+    {
+        bp = get_ptr(bp);
+    }
+    return bp;
+}
+
+// helper function
+// given ptr of free block and required block size
+// if free block has room for another free block after allocated, split
+// if not, allocate the whole block
+static void allocate(arena *a, char *bp, size_t allocate_size)
+{
+    // get total size of free block
+    size_t total_size = get_size(get_header(bp));
+    size_t remain_size = total_size - allocate_size;
+    uint64_t prev_bits = get_prevbits(get_header(bp));
+    bool decommitted = get_decommitted(get_header(bp));
+
+    reset_free(a, bp); // take the block off its free list
+
+    // if free block is big enough, split
+    if (remain_size >= MIN_BLOCK_SIZE)
+    {
+        // update size and alloc bit of header in allocated block, no footer
+        put(get_header(bp), pack(allocate_size, prev_bits | ALLOC) | owner_bits(a));
+
+        char *remainblk = bp + allocate_size;
+
+        // update size and alloc bit of header and footer in remaining block
+        set_free_block(a, remainblk, remain_size, follow_bits(true));
+        update_next(remainblk);
+
+        // the pages the remaining block keeps are still decommitted
+        if (decommitted)
+        {
+            put(get_header(remainblk), *(uint64_t *)get_header(remainblk) | DECOMMITTED);
+        }
+
+        // printf("split %p success! \ntotal_size: %zu\nallocate_size: %zu\nremain_size: %zu \nnew free blk: %p\n", (void *)bp, total_size, allocate_size, remain_size, remainblk);
+
+        // coalesce and insert remain free block into free list
+        char *coalece_block = coalesce(a, remainblk);
+        insert_free(a, coalece_block, get_size(get_header(coalece_block)));
+    }
+    else
+    {
+        // if not, allocate the whole block
+        put(get_header(bp), pack(total_size, prev_bits | ALLOC) | owner_bits(a));
+        update_next(bp);
+    }
+}
+
+// helper function
+// given ptr of allocated block and the block size it should shrink to
+// if the tail can hold a free block, split it off and give it back to the free lists
+static void shrink_block(arena *a, char *bp, size_t new_size)
+{
+    size_t total_size = get_size(get_header(bp));
+    size_t remain_size = total_size - new_size;
+
+    // tail too small to hold a free block, keep it as padding
+    if (remain_size < MIN_BLOCK_SIZE)
+    {
+        return;
+    }
+
+    // update size of header in allocated block
+    put(get_header(bp), pack(new_size, get_prevbits(get_header(bp)) | ALLOC) | owner_bits(a));
+
+    char *remainblk = bp + new_size;
+
+    // update size and alloc bit of header and footer in remaining block,
+    // block after the tail now follows a free block
+    set_free_block(a, remainblk, remain_size, follow_bits(true));
+    update_next(remainblk);
+
+    // next block may be free, coalesce and insert remain free block into free list
+    char *coalece_block = coalesce(a, remainblk);
+    size_t coalesced_size = get_size(get_header(coalece_block));
+    insert_free(a, coalece_block, coalesced_size);
+
+    // a top that grew to trim_threshold is trimmed right away
+    if (coalece_block == a->top && coalesced_size >= trim_threshold)
+    {
+        trim_arena(a, TRIM_PAD);
+    }
+}
+
+// helper function
+// given ptr of allocated block and the block size it should grow to
+// absorb the next block if it is free, and extend the heap if the block
+// (together with that free block) is the last one before the epilogue
+// returns false if the block can't grow without moving
+static bool grow_block(arena *a, char *bp, size_t new_size)
+{
+    size_t avail_size = get_size(get_header(bp));
+    char *next_blk = get_nextblk(bp);
+    bool next_free = !get_alloc(get_header(next_blk));
+    if (next_free)
+    {
+        avail_size += get_size(get_header(next_blk));
+    }
+
+    if (avail_size < new_size)
+    {
+        char *after_blk = next_free ? get_nextblk(next_blk) : next_blk;
+        if (after_blk != a->heap_end) // not the epilogue of the chunk that can grow
+        {
+            return false;
+        }
+        // block is at the end of the heap, extend by the missing bytes only
+        // extend_heap merges the new space with next block if that is free
+        char *ext_blk = extend_heap(a, new_size - avail_size);
+        if (ext_blk == NULL)
+        {
+            return false;
+        }
+        if (ext_blk != (next_free ? next_blk : after_blk)) // brk moved, got a new chunk
+        {
+            insert_free(a, ext_blk, get_size(get_header(ext_blk)));
+            return false;
+        }
+        avail_size = get_size(get_header(bp)) + get_size(get_header(ext_blk));
+        next_free = false; // already taken off the free list by extend_heap
+    }
+
+    // delete next block from free list, before header and footer are updated
+    if (next_free)
+    {
+        reset_free(a, next_blk);
+    }
+    put(get_header(bp), pack(avail_size, get_prevbits(get_header(bp)) | ALLOC) | owner_bits(a));
+    update_next(bp);
+
+    // give back whatever is left over
+    shrink_block(a, bp, new_size);
+    return true;
+}
+
+// helper function
+// given block size, find a free block it fits in, from the free lists or the
+// end of the heap. returns NULL if out of memory
+static void *find_or_extend(arena *a, size_t block_size)
+{
+    // search free list for a fit
+    char *bp = find_free_list(a, block_size);
+    if (bp == NULL)
+    {
+        // no fit found, extend heap, the surplus stays free at its end
+        bp = extend_heap(a, grow_size(a, block_size));
+        if (bp != NULL && get_size(get_header(bp)) < block_size)
+        {
+            // brk moved before the tail could grow, take a block that surely fits
+            insert_free(a, bp, get_size(get_header(bp)));
+            bp = extend_heap(a, block_size);
+        }
+    }
+    return bp;
+}
+
+// helper function
+// given block size, take a regular block from the free lists or the end of the heap
+static void *alloc_block(arena *a, size_t block_size)
+{
+    char *bp = find_or_extend(a, block_size);
+    if (bp == NULL)
+    {
+        return NULL;
+    }
+    allocate(a, bp, block_size);
+
+    // printf("malloc success! addr: %p, size: %zu\n\n", (void *)bp, block_size);
+
+    check_arena(a, __LINE__);
+    return bp;
+}
+
+// helper function
+// given a power of two alignment and block size, allocate a regular block whose
+// payload is aligned. The gap in front of the payload goes back to the free lists
+static void *alloc_aligned(arena *a, size_t alignment, size_t block_size)
+{
+    // payload addresses step by ALIGNMENT, so the gap is at most alignment -
+    // ALIGNMENT, or alignment + ALIGNMENT when it must grow to hold a free
+    // block. A block of the size class itself may happen to leave room for it
+    size_t search_size = block_size + alignment + MIN_BLOCK_SIZE - ALIGNMENT;
+    char *bp = find_free_list(a, block_size);
+    if (bp != NULL && get_size(get_header(bp)) < (size_t)(aligned_payload(bp, alignment) - bp) + block_size)
+    {
+        bp = find_free_list(a, search_size);
+    }
+    if (bp == NULL && a->heap_end == (char *)mm_heap_hi() + 1)
+    {
+        // the arena's last chunk ends at brk, so grow it just enough for an
+        // aligned payload, together with its last block if that one is free
+        bp = a->heap_end; // payload of the block extend_heap adds
+        if (!get_prevalloc(get_header(bp)))
+        {
+            bp = get_prevblk(bp);
+        }
+        size_t tail_size = a->heap_end - bp;
+        size_t need_size = (size_t)(aligned_payload(bp, alignment) - bp) + block_size;
+        if (need_size > tail_size)
+        {
+            bp = extend_heap(a, need_size - tail_size);
+        }
+    }
+    if (bp == NULL)
+    {
+        bp = extend_heap(a, search_size);
+        if (bp == NULL)
+        {
+            return NULL;
+        }
+    }
+    reset_free(a, bp); // take the block off its free list, if it is on one
+
+    char *aligned_bp = aligned_payload(bp, alignment);
+    if (get_size(get_header(bp)) < (size_t)(aligned_bp - bp) + block_size)
+    {
+        // brk moved before the tail could grow, take a block that surely fits
+        insert_free(a, bp, get_size(get_header(bp)));
+        bp = extend_heap(a, search_size);
+        if (bp == NULL)
+        {
+            return NULL;
+        }
+        aligned_bp = aligned_payload(bp, alignment);
+    }
+
+    size_t total_size = get_size(get_header(bp));
+    uint64_t prev_bits = get_prevbits(get_header(bp));
+    size_t gap_size = aligned_bp - bp;
+
+    // any gap holds a free block, its prev block is allocated since bp was
+    // free, so it goes straight into a free list
+    if (gap_size > 0)
+    {
+        set_free_block(a, bp, gap_size, prev_bits);
+        insert_free(a, bp, gap_size);
+        prev_bits = follow_bits(false);
+    }
+
+    // the rest is a free block in no list, allocate splits off its tail
+    set_free_block(a, aligned_bp, total_size - gap_size, prev_bits);
+    allocate(a, aligned_bp, block_size);
+
+    check_arena(a, __LINE__);
+    return aligned_bp;
+}
+
+// helper function
+// given block size and a count, allocate that many regular blocks into out.
+// A free block that holds all of them, or the heap grown once by all of
+// them if there is none, is cut into pieces in a single pass. Only if that
+// runs out of memory are they allocated one by one. returns how many were
+// allocated
+static size_t alloc_batch(arena *a, size_t block_size, size_t n, void **out)
+{
+    size_t done = 0;
+    char *bp = n > 1 && block_size <= SIZE_MAX / n ? find_or_extend(a, block_size * n) : NULL;
+    if (bp != NULL)
+    {
+        allocate(a, bp, block_size * n);
+        // every piece follows an allocated piece except the first, the
+        // last keeps any padding the whole block came with. The block
+        // after the last piece already follows an allocated block
+        size_t total_size = get_size(get_header(bp));
+        uint64_t prev_bits = get_prevbits(get_header(bp));
+        for (; done < n; done++)
+        {
+            size_t piece_size = done == n - 1 ? total_size - (n - 1) * block_size : block_size;
+            put(get_header(bp), pack(piece_size, prev_bits | ALLOC) | owner_bits(a));
+            out[done] = bp;
+            bp += piece_size;
+            prev_bits = PREV_ALLOC;
+        }
+        check_arena(a, __LINE__);
+    }
+    for (; done < n; done++)
+    {
+        if ((out[done] = alloc_block(a, block_size)) == NULL)
+        {
+            break;
+        }
+    }
+    return done;
+}
+
+// helper function
+// given ptr of regular allocated block, free it and give it back to the free lists
+static void free_block(arena *a, char *bp)
+{
+    char *curr_header = get_header(bp);
+
+    // check if bp is allocated
+    if (!get_alloc(curr_header))
+    {
+        return;
+    }
+
+    // printf("attempt to free %p, size: %zu\n", bp, get_size(curr_header));
+
+    free_span(a, bp, get_size(curr_header), 1);
+}
+
+// helper function
+// given ptr of the first of count allocated blocks that lie back to back &
+// their total size, free them as one block and give it back to the free lists
+static void free_span(arena *a, char *bp, size_t size, size_t count)
+{
+    // update alloc bit of header, add footer and clear out prev and next ptr,
+    // the headers of the blocks after the first are plain payload now
+    set_free_block(a, bp, size, get_prevbits(get_header(bp)));
+
+    // each time free, update next blk's prev bits
+    update_next(bp);
+
+    // coalesce and insert free block into free list
+    char *coalece_block = coalesce(a, bp);
+    size_t coalesced_size = get_size(get_header(coalece_block));
+    insert_free(a, coalece_block, coalesced_size);
+
+    // a top that grew to trim_threshold is trimmed right away
+    if (coalece_block == a->top && coalesced_size >= trim_threshold)
+    {
+        trim_arena(a, TRIM_PAD);
+    }
+
+    // every DECOMMIT_AGE frees, big blocks that stayed free that long give
+    // their pages back
+    uint64_t old_clock = a->free_clock;
+    a->free_clock += count;
+    if (a->free_clock / DECOMMIT_AGE != old_clock / DECOMMIT_AGE)
+    {
+        release_sweep(a, false);
+    }
+}
+
+// helper function
+// given an array of ptrs, sort it by address in place. Heap sort, so it
+// needs no memory and no recursion however long the batch is. Batches from
+// mm_malloc_batch mostly come back in order, those are only checked
+static void sort_ptrs(void **ptrs, size_t n)
+{
+    size_t sorted = 1;
+    while (sorted < n && (uintptr_t)ptrs[sorted - 1] <= (uintptr_t)ptrs[sorted])
+    {
+        sorted++;
+    }
+    if (sorted >= n)
+    {
+        return;
+    }
+    for (size_t end = n, start = n / 2; end > 1;)
+    {
+        void *item;
+        if (start > 0)
+        {
+            item = ptrs[--start]; // building the heap
+        }
+        else
+        {
+            item = ptrs[--end]; // moving the largest to the end
+            ptrs[end] = ptrs[0];
+        }
+        size_t hole = start;
+        for (size_t child = 2 * hole + 1; child < end; child = 2 * hole + 1)
+        {
+            if (child + 1 < end && (uintptr_t)ptrs[child + 1] > (uintptr_t)ptrs[child])
+            {
+                child++;
+            }
+            if ((uintptr_t)ptrs[child] <= (uintptr_t)item)
+            {
+                break;
+            }
+            ptrs[hole] = ptrs[child];
+            hole = child;
+        }
+        ptrs[hole] = item;
+    }
+}
+
+// helper function
+// given ptr of a free block, give back the whole pages between its header,
+// list ptrs and age and its footer, and mark the block so it isn't done twice
+static void decommit_block(char *bp)
+{
+    uintptr_t page_lo = ((uintptr_t)bp + 3 * WSIZE + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+    uintptr_t page_hi = (uintptr_t)get_footer(bp) & ~(uintptr_t)(PAGE_SIZE - 1);
+    if (page_lo < page_hi)
+    {
+        mm_madvise((void *)page_lo, page_hi - page_lo, MADV_DONTNEED);
+    }
+    put(get_header(bp), *(uint64_t *)get_header(bp) | DECOMMITTED);
+}
+
+// helper function
+// given an arena whose lock is held, give back the pages of free blocks of
+// DECOMMIT_MIN bytes that stayed free for DECOMMIT_AGE frees, the top
+// included. Blocks that are reused quickly keep their
+// pages, so a heap that shrinks and grows again doesn't fault them back in
+// each time. all gives back the pages of the top and of every block in the
+// large tree whatever their age, for mm_trim. returns true if it gave back
+// any block's pages
+static bool release_sweep(arena *a, bool all)
+{
+    bool released = false;
+    size_t min_size = all ? LARGE_MIN : DECOMMIT_MIN;
+    char *top = a->top;
+    if (top != NULL && (all || is_old(a, top)) && get_size(get_header(top)) >= min_size && !get_decommitted(get_header(top)))
+    {
+        decommit_block(top);
+        released = true;
+    }
+
+    // blocks of min_size bytes are in the large tree, visit them by size
+    size_t size = min_size;
+    char *addr = NULL;
+    char *bp;
+    while ((bp = tree_find(a, size, addr)) != NULL)
+    {
+        char *header = get_header(bp);
+        if (!get_decommitted(header) && (all || is_old(a, bp)))
+        {
+            decommit_block(bp);
+            released = true;
+        }
+        size = get_size(header);
+        addr = bp + 1;
+    }
+    return released;
+}
+
+// helper function
+// given an arena whose lock is held, shrink brk to give back its top, if the
+// arena's last chunk ends at brk. pad bytes of the top stay, rounded up so
+// brk stays page aligned. returns true if brk moved
+static bool trim_arena(arena *a, size_t pad)
+{
+    arena_table *t = get_table();
+    bool trimmed = false;
+    spin_lock(&t->brk_lock);
+    char *end = a->heap_end;
+    if (a->top != NULL && end == (char *)mm_heap_hi() + 1)
+    {
+        char *bp = a->top;
+        char *new_end = (char *)(((uintptr_t)bp + align(pad) + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1));
+        if (new_end > bp && new_end - bp < MIN_BLOCK_SIZE)
+        {
+            new_end += PAGE_SIZE; // too little left for a free block
+        }
+        if (new_end < end)
+        {
+            uint64_t prev_bits = get_prevbits(get_header(bp));
+            size_t keep_size = new_end - bp;
+            reset_free(a, bp);
+            mm_sbrk(-(intptr_t)(end - new_end));
+            a->heap_end = new_end;
+
+            // the kept part stays free as the top, the epilogue moves down behind it
+            if (keep_size > 0)
+            {
+                set_free_block(a, bp, keep_size, prev_bits);
+                insert_free(a, bp, keep_size);
+                put(get_header(new_end), pack(0, ALLOC) | follow_bits(false));
+            }
+            else
+            {
+                put(get_header(bp), pack(0, ALLOC) | prev_bits);
+            }
+            trimmed = true;
+        }
+    }
+    spin_unlock(&t->brk_lock);
+    return trimmed;
+}
+
+// helper function
+// given payload size, map whole pages for a block of its own. The header holds
+// the size of the mapping, no arena owns the block and no lock is needed
+static void *map_alloc(size_t alignment, size_t size)
+{
+    // the payload sits alignment bytes into the mapping, at least MAP_OFFSET
+    // and at most a page. Bigger alignments map the slack too, then unmap the
+    // pages in front of the aligned payload and behind the block
+    size_t offset = alignment < MAP_OFFSET ? MAP_OFFSET : alignment < PAGE_SIZE ? alignment : PAGE_SIZE;
+    size_t map_size = (size + offset + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    size_t slack = alignment > PAGE_SIZE ? alignment - PAGE_SIZE : 0;
+    char *p = mm_mmap(map_size + slack);
+    if (p == (void *)-1)
+    {
+        return NULL;
+    }
+    char *bp = (char *)(((uintptr_t)p + offset + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    size_t lead = bp - offset - p;
+    if (lead > 0)
+    {
+        mm_munmap(p, lead);
+    }
+    if (slack > lead)
+    {
+        mm_munmap(bp - offset + map_size, slack - lead);
+    }
+    put(get_header(bp), pack(map_size, 1));
+    return bp;
+}
+
+// helper function
+// given ptr of a mapped block, hand its pages straight back
+static void map_free(char *bp)
+{
+    mm_munmap(map_start(bp), get_size(get_header(bp)));
+}
+
+// helper function
+// given ptr of a mapped block and new payload size, shrink it in place by
+// unmapping its tail pages, otherwise move it
+static void *map_realloc(char *bp, size_t size)
+{
+    size_t map_size = get_size(get_header(bp));
+    size_t offset = bp - map_start(bp);
+    size_t need_size = (size + offset + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    if (size >= MMAP_THRESHOLD && need_size <= map_size)
+    {
+        if (need_size < map_size)
+        {
+            mm_munmap(map_start(bp) + need_size, map_size - need_size);
+            put(get_header(bp), pack(need_size, 1));
+        }
+        return bp;
+    }
+
+    // a mapping has no room to grow, and small blocks belong in the heap
+    void *newptr = malloc(size);
+    if (newptr == NULL)
+    {
+        return NULL;
+    }
+    size_t old_payload = map_size - offset;
+    mm_memcpy(newptr, bp, size < old_payload ? size : old_payload);
+    map_free(bp);
+    return newptr;
+}
+
+// page map helper function
+// given any ptr into the heap, get the run owning its page, NULL if none
+// nodes are never freed and entries change atomically, so no lock is needed
+static slab_run *page_map_get(void *p)
+{
+    char *node = __atomic_load_n(&page_map, __ATOMIC_ACQUIRE);
+    for (int level = PAGE_MAP_LEVELS - 1; level >= 0 && node != NULL; level--)
+    {
+        uint64_t *entry = (uint64_t *)(node + get_page_index(p, level) * WSIZE);
+        node = (char *)__atomic_load_n(entry, __ATOMIC_ACQUIRE);
+    }
+    return (slab_run *)node;
+}
+
+// page map helper function
+// given ptr of a page and its run (or NULL), record it, inner nodes are
+// regular blocks of arena a allocated on demand. Arenas race to install a
+// node with compare and swap, the loser frees its own. returns false if out of memory
+static bool page_map_set(arena *a, void *p, slab_run *run)
+{
+    size_t node_size = PAGE_MAP_FANOUT * WSIZE;
+    char *node = __atomic_load_n(&page_map, __ATOMIC_ACQUIRE);
+    if (node == NULL)
+    {
+        char *root = alloc_block(a, adjust_size(node_size));
+        if (root == NULL)
+        {
+            return false;
+        }
+        memset(root, 0, node_size);
+        if (__atomic_compare_exchange_n(&page_map, &node, root, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            node = root;
+        }
+        else
+        {
+            free_block(a, root);
+        }
+    }
+
+    for (int level = PAGE_MAP_LEVELS - 1; level > 0; level--)
+    {
+        uint64_t *entry = (uint64_t *)(node + get_page_index(p, level) * WSIZE);
+        uint64_t child = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+        if (child == 0)
+        {
+            char *fresh = alloc_block(a, adjust_size(node_size));
+            if (fresh == NULL)
+            {
+                return false;
+            }
+            memset(fresh, 0, node_size);
+            if (__atomic_compare_exchange_n(entry, &child, (uint64_t)fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                child = (uint64_t)fresh;
+            }
+            else
+            {
+                free_block(a, fresh);
+            }
+        }
+        node = (char *)child;
+    }
+    __atomic_store_n((uint64_t *)(node + get_page_index(p, 0) * WSIZE), (uint64_t)run, __ATOMIC_RELEASE);
+    return true;
+}
+
+// slab helper function
+// given slab class, carve a page aligned block into a run and put it on its list
+static slab_run *new_run(arena *a, int cls)
+{
+    // block of exactly one page, the header of the block after it takes the
+    // last word of the page, so runs carved back to back waste nothing
+    slab_run *run = alloc_aligned(a, PAGE_SIZE, PAGE_SIZE);
+    if (run == NULL)
+    {
+        return NULL;
+    }
+    if (!page_map_set(a, run, run))
+    {
+        free_block(a, (char *)run);
+        return NULL;
+    }
+
+    run->slab_class = cls;
+    run->slot_size = slab_slot_size(cls);
+    run->slot_count = (PAGE_SIZE - WSIZE - align(sizeof(slab_run))) / run->slot_size;
+    run->free_count = run->slot_count;
+    for (int i = 0; i < RUN_MAP_WORDS; i++)
+    {
+        // mark slots 0..slot_count-1 free
+        int slots_left = run->slot_count - 64 * i;
+        if (slots_left >= 64)
+        {
+            run->free_map[i] = ~(uint64_t)0;
+        }
+        else
+        {
+            run->free_map[i] = slots_left > 0 ? ((uint64_t)1 << slots_left) - 1 : 0;
+        }
+    }
+    link_run(run, get_slab_root(a, cls));
+
+    // printf("new run %p, slot size: %u, slots: %u\n", (void *)run, run->slot_size, run->slot_count);
+    return run;
+}
+
+static void link_run(slab_run *run, char *root)
+{
+    // only runs with free slots are on the list, new ones go first
+    run->prev = NULL;
+    run->next = (slab_run *)get_ptr(root);
+    if (run->next != NULL)
+    {
+        run->next->prev = run;
+    }
+    set_ptr(root, (char *)run);
+}
+
+static void unlink_run(slab_run *run, char *root)
+{
+    if (run->prev != NULL)
+    {
+        run->prev->next = run->next;
+    }
+    else
+    {
+        set_ptr(root, (char *)run->next);
+    }
+    if (run->next != NULL)
+    {
+        run->next->prev = run->prev;
+    }
+    run->prev = NULL;
+    run->next = NULL;
+}
+
+// slab helper function
+// given request size, take the lowest free slot of the first run with one
+static void *slab_alloc(arena *a, size_t size)
+{
+    int cls = slab_class(size);
+    char *root = get_slab_root(a, cls);
+    slab_run *run = (slab_run *)get_ptr(root);
+    if (run == NULL)
+    {
+        run = new_run(a, cls);
+        if (run == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    int word = 0;
+    while (run->free_map[word] == 0)
+    {
+        word++;
+    }
+    int bit = find_first_set(run->free_map[word]);
+    run->free_map[word] &= ~((uint64_t)1 << bit);
+
+    // full runs leave the list until one of their slots is freed
+    if (--run->free_count == 0)
+    {
+        unlink_run(run, root);
+    }
+    return get_slots(run) + (size_t)(word * 64 + bit) * run->slot_size;
+}
+
+// slab helper function
+// given run and ptr of one of its slots, mark the slot free. An empty run goes
+// back to the regular free lists, unless it is the last run of its class
+static void slab_free(arena *a, slab_run *run, char *ptr)
+{
+    size_t slot = (size_t)(ptr - get_slots(run)) / run->slot_size;
+    uint64_t mask = (uint64_t)1 << (slot % 64);
+
+    // slot is already free
+    if (run->free_map[slot / 64] & mask)
+    {
+        return;
+    }
+    run->free_map[slot / 64] |= mask;
+
+    char *root = get_slab_root(a, run->slab_class);
+    if (++run->free_count == 1)
+    {
+        link_run(run, root);
+    }
+    else if (run->free_count == run->slot_count && (run->prev != NULL || run->next != NULL))
+    {
+        unlink_run(run, root);
+        page_map_set(a, run, NULL); // page is mapped already, can't fail
+        free_block(a, (char *)run);
+    }
+}
+
+// slab helper function
+// given run and ptr of one of its slots, free the slot under the lock of the run's arena
+static void free_slot(slab_run *run, char *ptr)
+{
+    arena *a = get_owner(get_header(run));
+    spin_lock(&a->lock);
+    slab_free(a, run, ptr);
+    spin_unlock(&a->lock);
+}
+
+// remote free helper function
+// given the owning arena and a block (or slot) of it, push the block on the
+// arena's remote list. Lock-free: many threads may push at once, while the
+// only other operation on the list is taking all of it in drain_remote()
+static void push_remote(arena *a, char *ptr)
+{
+    char *head = __atomic_load_n(&a->remote_list, __ATOMIC_RELAXED);
+    do
+    {
+        set_ptr(ptr, head);
+    } while (!__atomic_compare_exchange_n(&a->remote_list, &head, ptr, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// remote free helper function
+// given an arena, take its whole remote list and free the blocks in one go
+// under the arena's lock
+static void drain_remote(arena *a)
+{
+    if (__atomic_load_n(&a->remote_list, __ATOMIC_RELAXED) == NULL)
+    {
+        return;
+    }
+    char *ptr = __atomic_exchange_n(&a->remote_list, NULL, __ATOMIC_ACQUIRE);
+
+    spin_lock(&a->lock);
+    while (ptr != NULL)
+    {
+        char *next = get_ptr(ptr);
+        slab_run *run = page_map_get(ptr);
+        if (run != NULL)
+        {
+            slab_free(a, run, ptr);
+        }
+        else
+        {
+            free_block(a, ptr);
+        }
+        ptr = next;
+    }
+    check_arena(a, __LINE__);
+    spin_unlock(&a->lock);
+}
+
+// remote free helper function
+// given the calling thread's cache (or NULL) and a block, or a slot and its run,
+// give it back to the arena that owns it, directly if this thread is
+// attached to it, through the arena's remote list if not
+static void free_owned(thread_cache *cache, slab_run *run, char *ptr)
+{
+    arena *a = get_owner(get_header(run != NULL ? (char *)run : ptr));
+    if (cache != NULL && cache->arena != a)
+    {
+        push_remote(a, ptr);
+        return;
+    }
+    spin_lock(&a->lock);
+    if (run != NULL)
+    {
+        slab_free(a, run, ptr);
+    }
+    else
+    {
+        free_block(a, ptr);
+    }
+    spin_unlock(&a->lock);
+}
+
+static void init_arena(arena *a, uint32_t index)
+{
+    // lists, bitmaps and chunks all start out empty, fit vectors come with
+    // the first thread, see set_vectors
+    memset(a, 0, sizeof(arena));
+    a->index = index;
+    a->fit_policy = get_table()->fit_policy;
+}
+
+// thread helper function
+// get the calling thread's cache. On the first call after mm_init the thread
+// is attached to an arena nobody uses, or a new one, or once MAX_ARENAS
+// exist, to one shared round robin. returns NULL if out of memory
+static thread_cache *get_cache(void)
+{
+    if (local_epoch == heap_epoch)
+    {
+        return local_cache;
+    }
+
+    arena_table *t = get_table();
+    arena *a = NULL;
+    spin_lock(&t->lock);
+    for (uint32_t i = 0; i < t->arena_count && a == NULL; i++)
+    {
+        if (t->arenas[i]->threads == 0)
+        {
+            a = t->arenas[i];
+        }
+    }
+    if (a == NULL && t->arena_count < MAX_ARENAS)
+    {
+        // arenas live in the heap, next to the chunks of other arenas
+        spin_lock(&t->brk_lock);
+        a = mm_sbrk(align(sizeof(arena)));
+        spin_unlock(&t->brk_lock);
+        if (a == (void *)-1)
+        {
+            a = NULL;
+        }
+        else
+        {
+            init_arena(a, t->arena_count);
+            t->arenas[t->arena_count++] = a;
+        }
+    }
+    if (a == NULL)
+    {
+        a = t->arenas[t->next_shared++ % t->arena_count];
+    }
+    a->threads++;
+    spin_unlock(&t->lock);
+
+    spin_lock(&a->lock);
+    set_vectors(a);
+    thread_cache *cache = alloc_block(a, adjust_size(sizeof(thread_cache)));
+    spin_unlock(&a->lock);
+    if (cache == NULL)
+    {
+        spin_lock(&t->lock);
+        a->threads--;
+        spin_unlock(&t->lock);
+        return NULL;
+    }
+    memset(cache, 0, sizeof(thread_cache));
+    cache->arena = a;
+
+    // the arena may have been idle, blocks could be waiting for it
+    drain_remote(a);
+
+    local_cache = cache;
+    local_epoch = heap_epoch;
+    pthread_setspecific(cache_key, cache);
+    return cache;
+}
+
+// thread helper function
+// runs when a thread exits, gives its cached slots back to their runs and
+// detaches the thread, so the next thread can take over its arena
+static void flush_cache(void *p)
+{
+    // the heap was reset since the cache was made, nothing to give back
+    if (local_epoch != heap_epoch)
+    {
+        return;
+    }
+
+    thread_cache *cache = p;
+    for (int cls = 0; cls < SLAB_CLASS_COUNT; cls++)
+    {
+        char *slot = cache->bins[cls];
+        while (slot != NULL)
+        {
+            char *next = get_ptr(slot);
+            free_slot(page_map_get(slot), slot);
+            slot = next;
+        }
+    }
+
+    arena *a = cache->arena;
+    arena_table *t = get_table();
+    spin_lock(&t->lock);
+    a->threads--;
+    spin_unlock(&t->lock);
+
+    spin_lock(&a->lock);
+    free_block(a, (char *)cache);
+    spin_unlock(&a->lock);
+    local_cache = NULL;
+    local_epoch = 0;
+}
+
+/*
+ * mm_init: returns false on error, true on success.
+ */
+
+bool mm_init(void)
+{
+    // arena table and the first arena, rounded up so payloads stay aligned
+    size_t table_size = align(sizeof(arena_table));
+
+    // Create an empty heap
+    if ((heap_listp = mm_sbrk(table_size + align(sizeof(arena)))) == (void *)-1)
+    {
+        return false;
+    }
+    // initialize arena table, first arena and page map
+    arena_table *t = get_table();
+    memset(t, 0, sizeof(arena_table));
+    t->fit_policy = MM_FIT_FIRST;
+    t->prefetch = PREFETCH;
+    arena *a = (arena *)(heap_listp + table_size);
+    init_arena(a, 0);
+    t->arenas[0] = a;
+    t->arena_count = 1;
+    page_map = NULL;
+
+    // thread state of the previous heap is stale from now on
+    heap_epoch++;
+    if (!cache_key_made)
+    {
+        if (pthread_key_create(&cache_key, flush_cache) != 0)
+        {
+            return false;
+        }
+        cache_key_made = true;
+    }
+
+    // Extend the empty heap by 512 bytes, this is the first chunk
+    char *bp = extend_heap(a, 512);
+    if (bp == NULL)
+    {
+        return false;
+    }
+
+    // choose root and insert free block into free list
+    insert_free(a, bp, 512);
+    // printf("############################### initialize success ##################################### \n");
+    return true;
+}
+
+/*
+ * mm_trim
+ * gives the free block at brk back to the system, keeping pad bytes of it.
+ * Only the arena whose last chunk ends at brk can have such a block, so
+ * the pages of every arena's top and large free blocks are decommitted too,
+ * once the blocks other threads freed to it are back
+ */
+bool mm_trim(size_t pad)
+{
+    arena_table *t = get_table();
+    bool trimmed = false;
+    for (uint32_t i = 0; i < __atomic_load_n(&t->arena_count, __ATOMIC_ACQUIRE); i++)
+    {
+        // blocks other threads freed count as free too
+        arena *a = t->arenas[i];
+        drain_remote(a);
+        spin_lock(&a->lock);
+        trimmed |= trim_arena(a, pad);
+        trimmed |= release_sweep(a, true);
+        check_arena(a, __LINE__);
+        spin_unlock(&a->lock);
+    }
+    return trimmed;
+}
+
+/*
+ * mm_set_trim_threshold
+ * sets the size the free block at brk must reach before free trims it,
+ * SIZE_MAX turns automatic trimming off
+ */
+void mm_set_trim_threshold(size_t threshold)
+{
+    trim_threshold = threshold;
+}
+
+/*
+ * mm_set_heap_growth
+ * sets how far a malloc no free block fits grows the heap: by percent of
+ * the heap size, at most max bytes, or by the missing bytes if that is more.
+ * percent 0 grows by the missing bytes only. Call it before mm_init to cover
+ * a whole run
+ */
+void mm_set_heap_growth(unsigned percent, size_t max)
+{
+    growth_percent = percent;
+    growth_max = max;
+}
+
+/*
+ * mm_set_fit_policy
+ * sets how malloc picks a block from the free lists, see mm_fit_t, until
+ * the next mm_init. Values that are not an mm_fit_t are ignored. Each arena
+ * switches under its own lock, so other threads may allocate meanwhile
+ */
+void mm_set_fit_policy(mm_fit_t policy)
+{
+    // unknown policies are ignored
+    if ((unsigned)policy > MM_FIT_ADDRESS)
+    {
+        return;
+    }
+    // arenas made meanwhile take the new policy from the table
+    arena_table *t = get_table();
+    spin_lock(&t->lock);
+    t->fit_policy = policy;
+    for (uint32_t i = 0; i < t->arena_count; i++)
+    {
+        arena *a = t->arenas[i];
+        spin_lock(&a->lock);
+        a->fit_policy = policy;
+        set_vectors(a);
+        spin_unlock(&a->lock);
+    }
+    spin_unlock(&t->lock);
+}
+
+/*
+ * mm_set_prefetch
+ * turns prefetching during list walks on or off until the next mm_init,
+ * returns false if it was built without
+ */
+bool mm_set_prefetch(bool on)
+{
+    get_table()->prefetch = on;
+    return PREFETCH;
+}
+
+/*
+ * mm_list_nodes
+ * list nodes the searches of all arenas looked at since mm_init
+ */
+size_t mm_list_nodes(void)
+{
+    arena_table *t = get_table();
+    size_t nodes = 0;
+    for (uint32_t i = 0; i < __atomic_load_n(&t->arena_count, __ATOMIC_ACQUIRE); i++)
+    {
+        nodes += t->arenas[i]->walked;
+    }
+    return nodes;
+}
+
+/*
+ * malloc
+ */
+
+void *malloc(size_t size)
+{
+    // invalid request
+    if (size <= 0)
+    {
+        return NULL;
+    }
+
+    // large requests bypass the arenas, each gets a mapping
+    if (size >= MMAP_THRESHOLD)
+    {
+        return map_alloc(ALIGNMENT, size);
+    }
+
+    thread_cache *cache = get_cache();
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    arena *a = cache->arena;
+    void *bp;
+    drain_remote(a);
+
+    // small requests get a slot, no header
+    if (size <= SLAB_MAX)
+    {
+        // slots freed by this thread come back first, without the lock
+        int cls = slab_class(size);
+        char *slot = cache->bins[cls];
+        if (slot != NULL)
+        {
+            cache->bins[cls] = get_ptr(slot);
+            cache->counts[cls]--;
+            return slot;
+        }
+        spin_lock(&a->lock);
+        bp = slab_alloc(a, size);
+        spin_unlock(&a->lock);
+        return bp;
+    }
+
+    spin_lock(&a->lock);
+    bp = alloc_block(a, adjust_size(size)); // header and aligned payload
+    spin_unlock(&a->lock);
+    return bp;
+}
+
+/*
+ * free
+ */
+void free(void *ptr)
+{
+    // invalid request
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    // mapped blocks are unmapped right away
+    if (is_mapped(ptr))
+    {
+        map_free(ptr);
+        return;
+    }
+
+    thread_cache *cache = get_cache();
+    if (cache != NULL)
+    {
+        drain_remote(cache->arena);
+    }
+
+    // pages of slab runs are in the page map, anything else is a regular block
+    slab_run *run = page_map_get(ptr);
+    if (run != NULL && cache != NULL && get_owner(get_header(run)) == cache->arena)
+    {
+        // keep the slot for this thread's next malloc of its class, no lock.
+        // Slots of other arenas go back to their owner through free_owned
+        int cls = run->slab_class;
+        if (cache->counts[cls] < CACHE_MAX)
+        {
+            set_ptr(ptr, cache->bins[cls]);
+            cache->bins[cls] = ptr;
+            cache->counts[cls]++;
+            return;
+        }
+    }
+    free_owned(cache, run, ptr);
+}
+
+/*
+ * mm_free_sized
+ * frees ptr, given the size it was last allocated or reallocated with.
+ * Once the page map says it is a slot, it goes to the cache bin of its
+ * size without reading its run header. realloc moves slots that change
+ * class, so a bin only holds slots of its own class, or bigger ones from
+ * memalign that are aligned at least as well
+ */
+void mm_free_sized(void *ptr, size_t size)
+{
+    // invalid request
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    // only slots have a faster way back, the rest is freed as usual
+    slab_run *run = size > 0 && size <= SLAB_MAX && !is_mapped(ptr) ? page_map_get(ptr) : NULL;
+    if (!check_size(ptr, size, __LINE__) || run == NULL)
+    {
+        free(ptr);
+        return;
+    }
+
+    thread_cache *cache = get_cache();
+    if (cache != NULL)
+    {
+        drain_remote(cache->arena);
+    }
+
+    // the slot is of the class of size, realloc moves slots that change
+    // class. Only slots of this thread's arena are cached
+    int cls = slab_class(size);
+    if (cache != NULL && cache->counts[cls] < CACHE_MAX && get_owner(get_header(run)) == cache->arena)
+    {
+        set_ptr(ptr, cache->bins[cls]);
+        cache->bins[cls] = ptr;
+        cache->counts[cls]++;
+        return;
+    }
+    free_owned(cache, run, ptr);
+}
+
+/*
+ * mm_malloc_batch
+ * allocates n blocks of size bytes into out, taking the arena lock once. A
+ * free block that holds them all, or the heap grown once by all of them,
+ * is cut into equal pieces in one pass. returns how many were allocated,
+ * fewer than n only if out of memory
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+    size_t done = 0;
+    thread_cache *cache = size > 0 && size < MMAP_THRESHOLD ? get_cache() : NULL;
+    if (cache == NULL)
+    {
+        // mapped blocks and invalid requests go one by one
+        for (; done < n && (out[done] = malloc(size)) != NULL; done++)
+        {
+        }
+        return done;
+    }
+    arena *a = cache->arena;
+    drain_remote(a);
+
+    if (size <= SLAB_MAX)
+    {
+        // slots freed by this thread come back first, without the lock
+        int cls = slab_class(size);
+        for (; done < n && cache->bins[cls] != NULL; done++)
+        {
+            out[done] = cache->bins[cls];
+            cache->bins[cls] = get_ptr(cache->bins[cls]);
+            cache->counts[cls]--;
+        }
+        spin_lock(&a->lock);
+        for (; done < n && (out[done] = slab_alloc(a, size)) != NULL; done++)
+        {
+        }
+        spin_unlock(&a->lock);
+        return done;
+    }
+
+    spin_lock(&a->lock);
+    done = alloc_batch(a, adjust_size(size), n, out);
+    spin_unlock(&a->lock);
+    return done;
+}
+
+/*
+ * mm_free_batch
+ * frees the n blocks of ptrs, NULLs are skipped. ptrs is sorted by address
+ * and reordered. The blocks and slots go back under a single lock, neighbouring
+ * blocks as one span. Those of other arenas go on their remote lists
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    thread_cache *cache = get_cache();
+    if (cache == NULL)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            free(ptrs[i]);
+        }
+        return;
+    }
+    arena *a = cache->arena;
+    drain_remote(a);
+
+    // sorted, NULLs come first and mapped blocks last, they lie above the heap
+    sort_ptrs(ptrs, n);
+    size_t i = 0;
+    while (i < n && ptrs[i] == NULL)
+    {
+        i++;
+    }
+    spin_lock(&a->lock);
+    while (i < n && !is_mapped(ptrs[i]))
+    {
+        char *bp = ptrs[i++];
+        if (i > 1 && bp == ptrs[i - 2]) // freed already
+        {
+            continue;
+        }
+        // a run is only given back once all its slots are free, so the page
+        // map still knows the slots of the batch that come after
+        slab_run *run = page_map_get(bp);
+        arena *owner = get_owner(get_header(run != NULL ? (char *)run : bp));
+        if (owner != a)
+        {
+            push_remote(owner, bp);
+        }
+        else if (run != NULL)
+        {
+            slab_free(a, run, bp);
+        }
+        else if (get_alloc(get_header(bp)))
+        {
+            // allocated blocks that follow bp directly are freed along with
+            // it, slots never start where a block ends
+            size_t span_size = get_size(get_header(bp));
+            size_t count = 1;
+            while (i < n && (char *)ptrs[i] == bp + span_size && get_alloc(get_header(ptrs[i])))
+            {
+                span_size += get_size(get_header(ptrs[i++]));
+                count++;
+            }
+            free_span(a, bp, span_size, count);
+        }
+    }
+    check_arena(a, __LINE__);
+    spin_unlock(&a->lock);
+
+    for (; i < n; i++)
+    {
+        if (i == 0 || ptrs[i] != ptrs[i - 1])
+        {
+            map_free(ptrs[i]);
+        }
+    }
+}
+
+/*
+ * realloc
+ */
+void *realloc(void *oldptr, size_t size)
+{
+    if (size == 0)
+    {
+        free(oldptr);
+        return NULL;
+    }
+
+    if (oldptr == NULL)
     {
         oldptr = malloc(size);
         return oldptr;
     }
 
+    if (is_mapped(oldptr))
+    {
+        return map_realloc(oldptr, size);
+    }
+
+    // a slot can't change size, move unless the request is of its class.
+    // Cache bins only hold slots of their class, aligned slots rely on it
+    slab_run *run = page_map_get(oldptr);
+    if (run != NULL)
+    {
+        if (size <= SLAB_MAX && slab_class(size) == (int)run->slab_class)
+        {
+            return oldptr;
+        }
+        void *newptr = malloc(size);
+        if (newptr == NULL)
+        {
+            return NULL;
+        }
+        mm_memcpy(newptr, oldptr, size < run->slot_size ? size : run->slot_size);
+        free(oldptr);
+        return newptr;
+    }
+
+    arena *a = get_owner(get_header(oldptr));
+    size_t newsize = adjust_size(size);
+    spin_lock(&a->lock);
     size_t oldsize = get_size(get_header(oldptr));
-    if (oldsize == size + DSIZE)
+
+    // shrink in place, the tail goes back to the free lists
+    if (newsize <= oldsize)
+    {
+        shrink_block(a, oldptr, newsize);
+        check_arena(a, __LINE__);
+        spin_unlock(&a->lock);
+        return oldptr;
+    }
+
+    // grow in place into the next free block or the end of the heap
+    if (grow_block(a, oldptr, newsize))
     {
-        // printf("realloc same size, return oldptr\n");
+        check_arena(a, __LINE__);
+        spin_unlock(&a->lock);
         return oldptr;
     }
+    spin_unlock(&a->lock);
 
     // general case
     // allocate a new block
@@ -627,19 +2997,130 @@ void *realloc(void *oldptr, size_t size)
     }
 
     // copy data from old block to new block
-    // if new block is smaller than old block, copy small size bytes
-    if (size < oldsize - DSIZE)
+    // new block is bigger, so the whole old payload fits
+    mm_memcpy(newptr, oldptr, oldsize - WSIZE);
+
+    free(oldptr);
+    return newptr;
+}
+/*
+ * mm_realloc_sized
+ * realloc, given the size ptr was last allocated or reallocated with.
+ * A slot stays where it is if new_size is of the class of old_size, else
+ * it moves and is freed through mm_free_sized
+ */
+void *mm_realloc_sized(void *ptr, size_t old_size, size_t new_size)
+{
+    if (ptr == NULL)
+    {
+        return malloc(new_size);
+    }
+
+    if (new_size == 0)
     {
-        mm_memcpy(newptr, oldptr, size);
+        mm_free_sized(ptr, old_size);
+        return NULL;
     }
-    else if (size > oldsize - DSIZE)
+
+    // blocks that are not slots resize as usual
+    slab_run *run = old_size > 0 && old_size <= SLAB_MAX && !is_mapped(ptr) ? page_map_get(ptr) : NULL;
+    if (!check_size(ptr, old_size, __LINE__) || run == NULL)
     {
-        mm_memcpy(newptr, oldptr, oldsize);
+        return realloc(ptr, new_size);
     }
 
-    free(oldptr);
+    // the slot is of the class of old_size
+    if (new_size <= SLAB_MAX && slab_class(new_size) == slab_class(old_size))
+    {
+        return ptr;
+    }
+    void *newptr = malloc(new_size);
+    if (newptr == NULL)
+    {
+        return NULL;
+    }
+    mm_memcpy(newptr, ptr, old_size < new_size ? old_size : new_size);
+    mm_free_sized(ptr, old_size);
     return newptr;
 }
+
+/*
+ * memalign
+ * allocates size bytes at a multiple of alignment, a power of two. Small
+ * blocks come from a slab class whose slots are all aligned if there is
+ * one, which holds for alignments up to 64 as slots start 64 bytes into
+ * their run. The rest split the gap in front of the aligned payload off a
+ * free block, large ones get a mapping with the payload up to a page into
+ * it. returns NULL if alignment is not a power of two
+ */
+void *memalign(size_t alignment, size_t size)
+{
+    // invalid request
+    if (size <= 0 || alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        return NULL;
+    }
+
+    // every block is aligned that much
+    if (alignment <= ALIGNMENT)
+    {
+        return malloc(size);
+    }
+
+    if (size >= MMAP_THRESHOLD || alignment >= MMAP_THRESHOLD)
+    {
+        return map_alloc(alignment, size);
+    }
+
+    // the slot of an aligned class, through the thread cache like any other
+    int cls = size <= SLAB_MAX ? slab_aligned_class(size, alignment) : -1;
+    if (cls >= 0)
+    {
+        return malloc(slab_slot_size(cls));
+    }
+
+    thread_cache *cache = get_cache();
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    arena *a = cache->arena;
+    drain_remote(a);
+    spin_lock(&a->lock);
+    void *bp = alloc_aligned(a, alignment, adjust_size(size));
+    spin_unlock(&a->lock);
+    return bp;
+}
+
+/*
+ * aligned_alloc
+ * C11 aligned allocation, same as memalign
+ */
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+/*
+ * posix_memalign
+ * memalign that stores the block in memptr. returns EINVAL if alignment is
+ * not a power of two multiple of sizeof(void *), ENOMEM if out of memory
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+    {
+        return EINVAL;
+    }
+    *memptr = NULL;
+    if (size == 0)
+    {
+        return 0;
+    }
+    *memptr = memalign(alignment, size);
+    return *memptr != NULL ? 0 : ENOMEM;
+}
+
 /*
  * calloc
  * This function is not tested by mdriver, and has been implemented for you.
@@ -650,7 +3131,8 @@ void *calloc(size_t nmemb, size_t size)
     size *= nmemb;
 
     ptr = malloc(size);
-    if (ptr)
+    // fresh mappings are already zeroed
+    if (ptr && !is_mapped(ptr))
     {
         memset(ptr, 0, size);
     }
@@ -694,12 +3176,107 @@ bool mm_checkheap(int line_number)
 #ifdef DEBUG
     // Write code to check heap invariants here
     // IMPLEMENT THIS
-    for (int i = 0; i < 9; i++)
+    arena_table *t = get_table();
+    for (uint32_t i = 0; i < t->arena_count; i++)
+    {
+        if (t->arenas[i]->index != i || !check_arena(t->arenas[i], line_number))
+        {
+            return false;
+        }
+    }
+#endif // DEBUG
+    return true;
+}
+
+// check_arena: the checks of mm_checkheap for a single arena, helpers call
+// it on the arena they hold the lock of, other arenas may be changing
+static bool check_arena(arena *a, int line_number)
+{
+#ifdef DEBUG
+    for (int fl = 0; fl < FL_INDEX_COUNT; fl++)
+    {
+        // check bitmaps agree with the lists, find_free_list trusts them blindly
+        for (int sl = 0; sl < SL_INDEX_COUNT; sl++)
+        {
+            bool listed = get_ptr(get_root(a, fl, sl)) != NULL;
+            bool marked = (a->sl_bitmap[fl] >> sl) & 1;
+            if (listed != marked)
+            {
+                printf("Warning: second level bitmap out of date at line %d\n class: (%d, %d) non-empty: %d bit: %d\n", line_number, fl, sl, listed, marked);
+                return false;
+            }
+        }
+        if (((a->fl_bitmap >> fl) & 1) != (a->sl_bitmap[fl] != 0))
+        {
+            printf("Warning: first level bitmap out of date at line %d\n first level: %d\n", line_number, fl);
+            return false;
+        }
+    }
+    // walk every chunk, check prev alloc bits since allocated blocks have no footer
+    size_t free_count = 0;
+    for (char *chunk = a->first_chunk; chunk != NULL; chunk = get_ptr(chunk))
     {
-        for (char *curr = get_ptr(root_array[i]); in_heap(curr) && !is_epilogue(curr); curr = get_ptr(curr + WSIZE))
+        bool prev_alloc = true; // prologue
+        char *curr = chunk + 4 * WSIZE;
+        for (; !is_epilogue(curr); curr = get_nextblk(curr))
         {
+            bool curr_alloc = get_alloc(get_header(curr));
+            if (get_owner(get_header(curr)) != a)
+            {
+                printf("Warning: block owned by another arena at line %d\n addr: %p\n", line_number, curr);
+                return false;
+            }
+            if (get_prevalloc(get_header(curr)) != prev_alloc)
+            {
+                printf("Warning: prev alloc bit out of date at line %d\n addr: %p\n", line_number, curr);
+                return false;
+            }
+            if (curr_alloc && get_decommitted(get_header(curr)))
+            {
+                printf("Warning: allocated block marked decommitted at line %d\n addr: %p\n", line_number, curr);
+                return false;
+            }
+            free_count += !curr_alloc;
+            if (!prev_alloc && !curr_alloc)
+            {
+                printf("Warning: two consecutive free blocks escaped coalescing at line %d\n addr: %p\n", line_number, curr);
+                return false;
+            }
+            prev_alloc = curr_alloc;
+        }
+        if (get_prevalloc(get_header(curr)) != prev_alloc)
+        {
+            printf("Warning: epilogue prev alloc bit out of date at line %d\n addr: %p\n", line_number, curr);
+            return false;
+        }
+    }
+    // check every free block is in exactly one list
+    size_t listed_count = 0;
+    for (int i = 0; i < CLASS_COUNT; i++)
+    {
+        fit_vector *v = a->vectors != NULL && i < VECTOR_CLASS_COUNT ? &a->vectors[i] : NULL;
+        uint32_t class_count = 0;
+        for (char *curr = get_ptr(get_root(a, i / SL_INDEX_COUNT, i % SL_INDEX_COUNT)); in_heap(curr) && !is_epilogue(curr); curr = get_ptr(curr + WSIZE))
+        {
+            listed_count++;
+            class_count++;
+
+            // check the fit vector mirrors the list while it is not stale
+            if (v != NULL && !v->stale)
+            {
+                bool mirrored = false;
+                for (uint32_t j = 0; j < v->count && j < VECTOR_SLOTS; j++)
+                {
+                    mirrored |= v->blocks[j] == curr && v->sizes[j] == get_size(get_header(curr));
+                }
+                if (!mirrored)
+                {
+                    printf("Warning: listed block missing from its fit vector at line %d\n addr: %p\n", line_number, curr);
+                    return false;
+                }
+            }
 
-            // check header & footer size consistency
+            // check header and footer size consistency
             size_t head_size = get_size(get_header(curr));
             size_t foot_size = get_size(get_footer(curr));
             if (head_size != foot_size)
@@ -707,7 +3284,7 @@ bool mm_checkheap(int line_number)
                 printf("Warning: header & footer size inconsistent! \n line: %d\n addr: %p\n Head Size: %zu\n Foot Size: %zu\n\n", line_number, curr, head_size, foot_size);
                 return false;
             }
-            // check header & footer alloc bit consistency
+            // check header and footer alloc bit consistency
             if (get_alloc(get_header(curr)) != get_alloc(get_footer(curr)))
             {
                 printf("Warning: header & footer alloc bit inconsistent at line %d\n", line_number);
@@ -721,12 +3298,166 @@ bool mm_checkheap(int line_number)
             }
             // check size
             size_t size = get_size(get_header(curr));
-            if (pick_root(size) != i)
+            int fl, sl;
+            mapping_insert(size, &fl, &sl);
+            if (fl * SL_INDEX_COUNT + sl != i)
+            {
+                printf("Warning: size of current block doesn't mactch its lists %d\n size: %zu class_index:%d\n", line_number, size, i);
+                return false;
+            }
+        }
+        if (v != NULL && v->count != class_count)
+        {
+            printf("Warning: fit vector counts %u blocks but class %d lists %u at line %d\n", v->count, i, class_count, line_number);
+            return false;
+        }
+    }
+    // check the large tree is ordered and holds only big free blocks
+    char *tree_prev = NULL;
+    if (!check_tree(a->large_root, &tree_prev, &listed_count, line_number))
+    {
+        return false;
+    }
+    // the top ends the last chunk, any free block there is the top
+    if (a->top != NULL)
+    {
+        if (get_alloc(get_header(a->top)) || get_nextblk(a->top) != a->heap_end)
+        {
+            printf("Warning: top is not the free block at the end of the last chunk at line %d\n addr: %p\n", line_number, a->top);
+            return false;
+        }
+        listed_count++;
+    }
+    else if (a->heap_end != NULL && !get_prevalloc(get_header(a->heap_end)))
+    {
+        printf("Warning: free block at the end of the last chunk is not the top at line %d\n", line_number);
+        return false;
+    }
+    if (listed_count != free_count)
+    {
+        printf("Warning: %zu free blocks in the heap but %zu in the free lists at line %d\n", free_count, listed_count, line_number);
+        return false;
+    }
+    // check blocks waiting on the remote list are still allocated blocks of this arena
+    for (char *curr = a->remote_list; curr != NULL; curr = get_ptr(curr))
+    {
+        slab_run *run = page_map_get(curr);
+        char *blk = run != NULL ? (char *)run : curr;
+        if (!in_heap(curr) || !get_alloc(get_header(blk)) || get_owner(get_header(blk)) != a)
+        {
+            printf("Warning: remote list holds a block that is not an allocated block of the arena at line %d\n addr: %p\n", line_number, curr);
+            return false;
+        }
+    }
+    // check runs on the slab lists
+    for (int cls = 0; cls < SLAB_CLASS_COUNT; cls++)
+    {
+        slab_run *prev_run = NULL;
+        for (slab_run *run = (slab_run *)get_ptr(get_slab_root(a, cls)); run != NULL; run = run->next)
+        {
+            if (!in_heap(run) || ((uintptr_t)run & (PAGE_SIZE - 1)) != 0 || !get_alloc(get_header(run)))
+            {
+                printf("Warning: run is not an allocated page aligned block at line %d\n addr: %p\n", line_number, (void *)run);
+                return false;
+            }
+            if (get_owner(get_header(run)) != a)
+            {
+                printf("Warning: run owned by another arena at line %d\n addr: %p\n", line_number, (void *)run);
+                return false;
+            }
+            if (page_map_get(run) != run)
+            {
+                printf("Warning: run missing from the page map at line %d\n addr: %p\n", line_number, (void *)run);
+                return false;
+            }
+            if (run->prev != prev_run || (int)run->slab_class != cls || run->slot_size != slab_slot_size(cls))
+            {
+                printf("Warning: run list of slab class %d corrupted at line %d\n addr: %p\n", cls, line_number, (void *)run);
+                return false;
+            }
+            int free_slots = 0;
+            for (int i = 0; i < RUN_MAP_WORDS; i++)
+            {
+                free_slots += __builtin_popcountll(run->free_map[i]);
+            }
+            if (run->free_count == 0 || free_slots != run->free_count)
+            {
+                printf("Warning: free slot count of run out of date at line %d\n addr: %p\n", line_number, (void *)run);
+                return false;
+            }
+            prev_run = run;
+        }
+    }
+#endif // DEBUG
+    return true;
+}
+
+// check_tree: walk a subtree of the large tree in order, check every node
+// is a big free block with a larger key than the one before and count them
+static bool check_tree(char *node, char **prev, size_t *count, int line_number)
+{
+    if (node == NULL)
+    {
+        return true;
+    }
+    if (!check_tree(get_ptr(node), prev, count, line_number))
+    {
+        return false;
+    }
+    if (!in_heap(node) || get_alloc(get_header(node)) || get_size(get_header(node)) < LARGE_MIN)
+    {
+        printf("Warning: large tree holds a block that is not a big free block at line %d\n addr: %p\n", line_number, node);
+        return false;
+    }
+    if (*prev != NULL && tree_cmp(get_size(get_header(*prev)), *prev, node) >= 0)
+    {
+        printf("Warning: large tree out of order at line %d\n addr: %p\n", line_number, node);
+        return false;
+    }
+    *prev = node;
+    (*count)++;
+    return check_tree(get_ptr(node + WSIZE), prev, count, line_number);
+}
+
+// check_size: check the size given to mm_free_sized or mm_realloc_sized fits
+// the block, and that the bin of its class may hold the slot, as the size
+// stands in for the run header. Returns false if not, the block is then
+// freed or resized as usual
+static bool check_size(void *ptr, size_t size, int line_number)
+{
+#ifdef DEBUG
+    size_t block_size;
+    slab_run *run = is_mapped(ptr) ? NULL : page_map_get(ptr);
+    if (is_mapped(ptr))
+    {
+        block_size = get_size(get_header(ptr)) - (size_t)((char *)ptr - map_start(ptr));
+    }
+    else
+    {
+        if (run != NULL && (uintptr_t)run != ((uintptr_t)ptr & ~(uintptr_t)(PAGE_SIZE - 1)))
+        {
+            printf("Warning: slot not in the page of its run at line %d\n addr: %p\n", line_number, ptr);
+            return false;
+        }
+        if (run != NULL && size <= SLAB_MAX)
+        {
+            // slots of memalign may be of a bigger class, they are aligned
+            // to the lowest set bit of their offset and size, the slots of the
+            // class of size must not be aligned better
+            size_t have = align(sizeof(slab_run)) | run->slot_size;
+            size_t want = align(sizeof(slab_run)) | slab_slot_size(slab_class(size));
+            if (slab_class(size) > (int)run->slab_class || (have & -have) < (want & -want))
             {
-                printf("Warning: size of current block doesn't mactch its lists %d\n size: %zu root_index:%d\n", line_number, size, i);
+                printf("Warning: sized free with size %zu of a slot of class %u at line %d\n addr: %p\n", size, run->slab_class, line_number, ptr);
                 return false;
             }
         }
+        block_size = run != NULL ? run->slot_size : get_size(get_header(ptr)) - WSIZE;
+    }
+    if (size > block_size)
+    {
+        printf("Warning: sized free with size %zu of a %zu byte block at line %d\n addr: %p\n", size, block_size, line_number, ptr);
+        return false;
     }
 #endif // DEBUG
     return true;
@@ -8,6 +8,9 @@ extern void* mm_malloc (size_t size);
 extern void mm_free (void* ptr);
 extern void* mm_realloc(void* ptr, size_t size);
 extern void* mm_calloc (size_t nmemb, size_t size);
+extern void* mm_memalign (size_t alignment, size_t size);
+extern void* mm_aligned_alloc (size_t alignment, size_t size);
+extern int mm_posix_memalign (void** memptr, size_t alignment, size_t size);
 
 #else
 
@@ -16,10 +19,60 @@ extern void* malloc (size_t size);
 extern void free (void* ptr);
 extern void* realloc(void* ptr, size_t size);
 extern void* calloc (size_t nmemb, size_t size);
+extern void* memalign (size_t alignment, size_t size);
+extern void* aligned_alloc (size_t alignment, size_t size);
+extern int posix_memalign (void** memptr, size_t alignment, size_t size);
 
 #endif
 
 extern bool mm_init(void);
 
+/* Allocates n blocks of size bytes each into out, returns how many it
+   allocated, fewer than n only if out of memory */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+/* Frees the n blocks of ptrs, skipping NULLs. Sorts ptrs by address in
+   place, so blocks that lie next to each other are freed and coalesced as
+   one. ptrs is left reordered, pass a copy if its order matters */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* free and realloc for callers that know the size they last asked for, as
+   for C++ sized delete. The size picks the slab class of a slot, so its
+   run header is not read. Debug builds check it against the block */
+extern void mm_free_sized(void *ptr, size_t size);
+extern void *mm_realloc_sized(void *ptr, size_t old_size, size_t new_size);
+
+/* Gives the free memory at the end of the heap back to the system, keeping
+   pad bytes of it, and the pages of the big free blocks inside it, so the
+   resident size follows the live bytes. Returns true if any memory was
+   released */
+extern bool mm_trim(size_t pad);
+
+/* free trims the heap as soon as the free block at its end reaches
+   threshold bytes. SIZE_MAX turns automatic trimming off */
+extern void mm_set_trim_threshold(size_t threshold);
+
+/* A malloc that no free block fits grows the heap by percent of its size,
+   at most max bytes, or by what the request needs if that is more.
+   percent 0 grows by what the request needs only */
+extern void mm_set_heap_growth(unsigned percent, size_t max);
+
+/* How malloc picks a block from the free lists: the head of the first
+   list that surely fits, the smallest that fits, the first that fits after
+   where the last search stopped, the smallest of the first few that fit, or
+   the lowest address that fits. Other values are ignored. The policy is
+   part of the heap, mm_init starts over with first fit. Other threads may
+   keep allocating while it changes */
+typedef enum { MM_FIT_FIRST, MM_FIT_BEST, MM_FIT_NEXT, MM_FIT_GOOD, MM_FIT_ADDRESS } mm_fit_t;
+extern void mm_set_fit_policy(mm_fit_t policy);
+
+/* Walks along the free lists prefetch the next block while they test the
+   current one. Turns that on or off, returns false if mm.c was built with
+   PREFETCH=0 and never prefetches. mm_init turns it back on */
+extern bool mm_set_prefetch(bool on);
+
+/* Number of free list blocks the searches looked at since mm_init */
+extern size_t mm_list_nodes(void);
+
 /* This is for debugging.  Returns false if error encountered */
 extern bool mm_checkheap(int line_number);
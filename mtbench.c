@@ -0,0 +1,499 @@
+/*
+ * mtbench.c - Multi-threaded allocation patterns for the mm package
+ *
+ * The traces run by mdriver come from single-threaded programs, so
+ * they never hand a block from one thread to another. This benchmark
+ * runs the producer/consumer patterns that multi-threaded servers use:
+ *
+ *   pipeline  pairs of threads; one allocates, the other frees (an
+ *             odd thread out sits idle)
+ *   fanin     every thread but one allocates, the last one frees
+ *   fanout    one thread allocates, all the others free
+ *   scatter   in rounds, one thread allocates a batch of blocks and
+ *             then every thread frees its share of the batch
+ *
+ * For each pattern it reports the throughput in Kops/s (one malloc or
+ * one free is one op), the peak heap size from mem_heapsize (plus any
+ * bytes mapped by mm_mmap), the peak
+ * number of live payload bytes, and the blowup, i.e., the ratio of the
+ * two peaks. The peaks are sampled once per batch of blocks, so the
+ * threads share no counters between two mallocs or two frees.
+ */
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+/**********************
+ * Constants and macros
+ **********************/
+
+#define DEF_THREADS       4   /* default number of threads */
+#define DEF_BLOCKS   200000   /* default number of blocks per pattern */
+#define BATCH            64   /* blocks handed over in one queue slot */
+#define QUEUE_SLOTS      16   /* batches a queue can hold */
+#define ROUND_BLOCKS   4096   /* blocks per round in the scatter pattern */
+
+/******************************
+ * The key compound data types
+ *****************************/
+
+/* A batch of blocks handed from a producer to a consumer */
+typedef struct {
+    int count;
+    char *blocks[BATCH];
+} batch_t;
+
+/* A bounded queue of batches; a batch with count 0 means "no more" */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    int head;
+    int tail;
+    int used;
+    batch_t slots[QUEUE_SLOTS];
+} queue_t;
+
+/* The params of one benchmark thread */
+typedef struct {
+    int tid;
+    long blocks;          /* blocks this thread allocates (producers) */
+    int stops;            /* end markers this thread waits for (consumers) */
+    queue_t *in;          /* queue this thread frees from, or NULL */
+    queue_t *out;         /* queue this thread allocates into, or NULL */
+    uint64_t seed;        /* random state for block sizes */
+} worker_t;
+
+/* Summarizes one run of a pattern */
+typedef struct {
+    double secs;          /* wall-clock time of the run */
+    long ops;             /* number of mallocs and frees */
+} result_t;
+
+/********************
+ * Global variables
+ *******************/
+
+static int nthreads = DEF_THREADS;
+static long nblocks = DEF_BLOCKS;
+
+/* Live payload bytes and the two peaks, updated once per batch */
+static long live_bytes;
+static long peak_live;
+static long peak_heap;
+static long total_ops;
+
+/* Shared state of the scatter pattern */
+static pthread_barrier_t round_barrier;
+static char *round_blocks[ROUND_BLOCKS];
+static size_t round_sizes[ROUND_BLOCKS];
+
+/*********************
+ * Function prototypes
+ *********************/
+
+static void queue_init(queue_t *q);
+static void queue_put(queue_t *q, const batch_t *b);
+static void queue_get(queue_t *q, batch_t *b);
+static size_t next_size(uint64_t *seed);
+static char *bench_malloc(size_t size);
+static size_t bench_free(char *p);
+static void add_live(long bytes);
+static void *producer(void *ptr);
+static void *consumer(void *ptr);
+static void *scatter(void *ptr);
+static result_t run_pattern(const char *name);
+static void usage(char *prog);
+
+/*
+ * queue_init - Sets up an empty queue
+ */
+static void queue_init(queue_t *q)
+{
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    q->head = q->tail = q->used = 0;
+}
+
+/*
+ * queue_put - Appends a copy of b, waiting while the queue is full
+ */
+static void queue_put(queue_t *q, const batch_t *b)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->used == QUEUE_SLOTS)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    q->slots[q->tail] = *b;
+    q->tail = (q->tail + 1) % QUEUE_SLOTS;
+    q->used++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * queue_get - Removes the oldest batch into b, waiting while the queue
+ *    is empty
+ */
+static void queue_get(queue_t *q, batch_t *b)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->used == 0)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    *b = q->slots[q->head];
+    q->head = (q->head + 1) % QUEUE_SLOTS;
+    q->used--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * next_size - Draws a block size: mostly small objects, with a tail of
+ *    larger buffers, like the requests of a typical server
+ */
+static size_t next_size(uint64_t *seed)
+{
+    uint64_t x = *seed;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *seed = x;
+    if (x % 16 == 0)
+        return 512 + (x >> 8) % 3584;
+    return 16 + (x >> 8) % 240;
+}
+
+/*
+ * bench_malloc - Calls mm_malloc and stamps the size into the block so
+ *    the thread that frees it can check it
+ */
+static char *bench_malloc(size_t size)
+{
+    char *p;
+
+    if ((p = mm_malloc(size)) == NULL) {
+        fprintf(stderr, "mm_malloc(%zu) failed\n", size);
+        exit(1);
+    }
+    *(size_t *)p = size;
+    memset(p + sizeof(size_t), 0x5a, size - sizeof(size_t));
+    return p;
+}
+
+/*
+ * bench_free - Checks the size stamped by bench_malloc, frees the block
+ *    and returns its size
+ */
+static size_t bench_free(char *p)
+{
+    size_t size = *(size_t *)p;
+
+    if (size < 16 || size > 4096 || p[size - 1] != 0x5a) {
+        fprintf(stderr, "block %p was corrupted\n", (void *)p);
+        exit(1);
+    }
+    mm_free(p);
+    return size;
+}
+
+/*
+ * add_live - Adds bytes (negative once freed) to the live bytes of all
+ *    threads and updates the peaks. Producers call it once per batch,
+ *    before other threads can free the batch
+ */
+static void add_live(long bytes)
+{
+    long live, peak, heap;
+
+    live = __atomic_add_fetch(&live_bytes, bytes, __ATOMIC_RELAXED);
+    if (bytes < 0)
+        return;
+    peak = __atomic_load_n(&peak_live, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&peak_live, &peak, live,
+                                                       false, __ATOMIC_RELAXED,
+                                                       __ATOMIC_RELAXED))
+        ;
+    heap = (long)(mem_heapsize() + mem_mapsize());
+    peak = __atomic_load_n(&peak_heap, __ATOMIC_RELAXED);
+    while (heap > peak && !__atomic_compare_exchange_n(&peak_heap, &peak, heap,
+                                                       false, __ATOMIC_RELAXED,
+                                                       __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * producer - Allocates w->blocks blocks in batches and hands them to
+ *    w->out, then sends one end marker
+ */
+static void *producer(void *ptr)
+{
+    worker_t *w = (worker_t *)ptr;
+    batch_t b;
+    long i, bytes = 0;
+    size_t size;
+
+    b.count = 0;
+    for (i = 0; i < w->blocks; i++) {
+        size = next_size(&w->seed);
+        b.blocks[b.count++] = bench_malloc(size);
+        bytes += (long)size;
+        if (b.count == BATCH) {
+            add_live(bytes);
+            queue_put(w->out, &b);
+            b.count = 0;
+            bytes = 0;
+        }
+    }
+    if (b.count > 0) {
+        add_live(bytes);
+        queue_put(w->out, &b);
+    }
+    b.count = 0;
+    queue_put(w->out, &b);
+    __atomic_add_fetch(&total_ops, w->blocks, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*
+ * consumer - Frees every block that arrives on w->in until w->stops end
+ *    markers have been seen
+ */
+static void *consumer(void *ptr)
+{
+    worker_t *w = (worker_t *)ptr;
+    batch_t b;
+    long ops = 0, bytes;
+    int i;
+
+    while (w->stops > 0) {
+        queue_get(w->in, &b);
+        if (b.count == 0) {
+            w->stops--;
+            continue;
+        }
+        bytes = 0;
+        for (i = 0; i < b.count; i++)
+            bytes += (long)bench_free(b.blocks[i]);
+        add_live(-bytes);
+        ops += b.count;
+    }
+    __atomic_add_fetch(&total_ops, ops, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*
+ * scatter - One round: thread 0 allocates ROUND_BLOCKS blocks, then
+ *    every thread frees the blocks whose number is its tid modulo
+ *    nthreads
+ */
+static void *scatter(void *ptr)
+{
+    worker_t *w = (worker_t *)ptr;
+    long round, rounds = w->blocks / ROUND_BLOCKS;
+    long ops = 0, bytes;
+    int i;
+
+    for (round = 0; round < rounds; round++) {
+        if (w->tid == 0) {
+            bytes = 0;
+            for (i = 0; i < ROUND_BLOCKS; i++) {
+                round_sizes[i] = next_size(&w->seed);
+                round_blocks[i] = bench_malloc(round_sizes[i]);
+                bytes += (long)round_sizes[i];
+            }
+            add_live(bytes);
+            ops += ROUND_BLOCKS;
+        }
+        pthread_barrier_wait(&round_barrier);
+        bytes = 0;
+        for (i = w->tid; i < ROUND_BLOCKS; i += nthreads) {
+            assert(*(size_t *)round_blocks[i] == round_sizes[i]);
+            bytes += (long)bench_free(round_blocks[i]);
+            ops++;
+        }
+        add_live(-bytes);
+        pthread_barrier_wait(&round_barrier);
+    }
+    __atomic_add_fetch(&total_ops, ops, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*
+ * run_pattern - Runs one pattern on a fresh heap and returns its time
+ *    and op count
+ */
+static result_t run_pattern(const char *name)
+{
+    pthread_t tids[nthreads];
+    worker_t workers[nthreads];
+    queue_t *queues;
+    struct timespec start, end;
+    result_t res;
+    int t, pairs = nthreads / 2;
+
+    queues = (queue_t *)calloc(nthreads, sizeof(queue_t));
+    if (queues == NULL) {
+        fprintf(stderr, "calloc failed in run_pattern\n");
+        exit(1);
+    }
+    for (t = 0; t < nthreads; t++)
+        queue_init(&queues[t]);
+    memset(workers, 0, sizeof(workers));
+    for (t = 0; t < nthreads; t++) {
+        workers[t].tid = t;
+        workers[t].seed = 0x9e3779b97f4a7c15ull * (t + 1);
+    }
+
+    mem_reset_brk();
+    if (!mm_init()) {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+    live_bytes = peak_live = peak_heap = total_ops = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (strcmp(name, "pipeline") == 0) {
+        /* Thread 2k allocates into queue k and thread 2k+1 frees from it */
+        for (t = 0; t < 2 * pairs; t += 2) {
+            workers[t].blocks = nblocks / pairs;
+            workers[t].out = &queues[t / 2];
+            workers[t + 1].stops = 1;
+            workers[t + 1].in = &queues[t / 2];
+            pthread_create(&tids[t], NULL, producer, &workers[t]);
+            pthread_create(&tids[t + 1], NULL, consumer, &workers[t + 1]);
+        }
+        for (t = 0; t < 2 * pairs; t++)
+            pthread_join(tids[t], NULL);
+    } else if (strcmp(name, "fanin") == 0) {
+        /* Threads 1..n-1 allocate into one queue, thread 0 frees */
+        workers[0].stops = nthreads - 1;
+        workers[0].in = &queues[0];
+        pthread_create(&tids[0], NULL, consumer, &workers[0]);
+        for (t = 1; t < nthreads; t++) {
+            workers[t].blocks = nblocks / (nthreads - 1);
+            workers[t].out = &queues[0];
+            pthread_create(&tids[t], NULL, producer, &workers[t]);
+        }
+        for (t = 0; t < nthreads; t++)
+            pthread_join(tids[t], NULL);
+    } else if (strcmp(name, "fanout") == 0) {
+        /* Thread 0 allocates into one queue, threads 1..n-1 free; the
+           producer sends n-2 extra end markers, one per extra consumer */
+        workers[0].blocks = nblocks;
+        workers[0].out = &queues[0];
+        pthread_create(&tids[0], NULL, producer, &workers[0]);
+        for (t = 1; t < nthreads; t++) {
+            workers[t].stops = 1;
+            workers[t].in = &queues[0];
+            pthread_create(&tids[t], NULL, consumer, &workers[t]);
+        }
+        pthread_join(tids[0], NULL);
+        for (t = 2; t < nthreads; t++) {
+            batch_t stop = { 0 };
+            queue_put(&queues[0], &stop);
+        }
+        for (t = 1; t < nthreads; t++)
+            pthread_join(tids[t], NULL);
+    } else {
+        /* scatter: every thread takes part in every round */
+        pthread_barrier_init(&round_barrier, NULL, nthreads);
+        for (t = 0; t < nthreads; t++) {
+            workers[t].blocks = nblocks;
+            pthread_create(&tids[t], NULL, scatter, &workers[t]);
+        }
+        for (t = 0; t < nthreads; t++)
+            pthread_join(tids[t], NULL);
+        pthread_barrier_destroy(&round_barrier);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (live_bytes != 0) {
+        fprintf(stderr, "%s: %ld bytes still live\n", name, live_bytes);
+        exit(1);
+    }
+    res.secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    res.ops = total_ops;
+    free(queues);
+    return res;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-h] [-t <n>] [-n <blocks>] [pattern ...]\n", prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h          Print this message.\n");
+    fprintf(stderr, "\t-t <n>      Use <n> threads, at least 2 (default %d).\n",
+            DEF_THREADS);
+    fprintf(stderr, "\t-n <blocks> Allocate <blocks> blocks per pattern (default %d).\n",
+            DEF_BLOCKS);
+    fprintf(stderr, "Patterns: pipeline fanin fanout scatter (default all)\n");
+}
+
+/**************
+ * Main routine
+ **************/
+int main(int argc, char **argv)
+{
+    static char *all[] = { "pipeline", "fanin", "fanout", "scatter", NULL };
+    char **patterns = all;
+    result_t res;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "ht:n:")) != -1) {
+        switch (c) {
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'n':
+                nblocks = atol(optarg);
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+    if (nthreads < 2 || nblocks < ROUND_BLOCKS) {
+        usage(argv[0]);
+        exit(1);
+    }
+    if (optind < argc)
+        patterns = &argv[optind];
+    for (i = 0; patterns[i] != NULL; i++) {
+        if (strcmp(patterns[i], "pipeline") && strcmp(patterns[i], "fanin") &&
+            strcmp(patterns[i], "fanout") && strcmp(patterns[i], "scatter")) {
+            fprintf(stderr, "Unknown pattern %s\n", patterns[i]);
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    mem_init();
+    printf("%d threads, %ld blocks per pattern\n", nthreads, nblocks);
+    printf("%-9s %10s %10s %12s %12s %8s\n", "pattern", "Kops/s", "msecs",
+           "peak heap", "peak live", "blowup");
+    for (i = 0; patterns[i] != NULL; i++) {
+        res = run_pattern(patterns[i]);
+        printf("%-9s %10.0f %10.2f %12ld %12ld %8.2f\n", patterns[i],
+               res.ops / res.secs * 0.001, res.secs * 1000.0,
+               peak_heap, peak_live,
+               peak_live == 0 ? 0 : (double)peak_heap / peak_live);
+    }
+    mem_deinit();
+    return 0;
+}